@@ -0,0 +1,182 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2020 Tobias Kortkamp <tobik@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <sys/param.h>
+#include <stdint.h>
+#if HAVE_ERR
+# include <err.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocator.h"
+
+// Containers remember the allocator that was current when they were
+// created and use it for all of their memory until they are freed,
+// so changing the default later never mixes allocators.
+//
+// alloc and realloc return NULL on failure and do not need to zero
+// memory.  realloc is passed the old and new size in bytes and may be
+// NULL, in which case alloc, memcpy and free are used instead.  A NULL
+// allocator is the same as allocator_malloc.
+
+static void *malloc_alloc(void *, size_t);
+static void malloc_free(void *, void *);
+static void *malloc_realloc(void *, void *, size_t, size_t);
+
+const struct Allocator allocator_malloc = {
+	.alloc = malloc_alloc,
+	.realloc = malloc_realloc,
+	.free = malloc_free,
+};
+
+static const struct Allocator *allocator_default = &allocator_malloc;
+static __thread const struct Allocator *allocator_tls;
+
+void *
+malloc_alloc(void *ctx, size_t size)
+{
+	return malloc(size);
+}
+
+void
+malloc_free(void *ctx, void *ptr)
+{
+	free(ptr);
+}
+
+void *
+malloc_realloc(void *ctx, void *ptr, size_t old, size_t size)
+{
+	return realloc(ptr, size);
+}
+
+const struct Allocator *
+allocator_current(void)
+{
+	if (allocator_tls) {
+		return allocator_tls;
+	}
+	return __atomic_load_n(&allocator_default, __ATOMIC_ACQUIRE);
+}
+
+void
+allocator_set_default(const struct Allocator *allocator)
+{
+	if (allocator == NULL) {
+		allocator = &allocator_malloc;
+	}
+	__atomic_store_n(&allocator_default, allocator, __ATOMIC_RELEASE);
+}
+
+// Overrides the default for the calling thread until it is called
+// again.  Returns the previous override so that calls can be nested.
+const struct Allocator *
+allocator_use(const struct Allocator *allocator)
+{
+	const struct Allocator *prev = allocator_tls;
+	allocator_tls = allocator;
+	return prev;
+}
+
+void *
+allocator_alloc(const struct Allocator *allocator, size_t size)
+{
+	void *x = allocator_alloc_uninit(allocator, size);
+	memset(x, 0, size);
+	return x;
+}
+
+void *
+allocator_alloc_uninit(const struct Allocator *allocator, size_t size)
+{
+	if (allocator == NULL) {
+		allocator = &allocator_malloc;
+	}
+	void *x = allocator->alloc(allocator->ctx, size);
+	if (x == NULL) {
+		warn("malloc");
+		abort();
+	}
+	return x;
+}
+
+void *
+allocator_recallocarray(const struct Allocator *allocator, void *ptr, size_t oldnmemb, size_t nmemb, size_t size)
+{
+	if (allocator == NULL) {
+		allocator = &allocator_malloc;
+	}
+	if (size > 0 && (nmemb > SIZE_MAX / size || oldnmemb > SIZE_MAX / size)) {
+		warnx("recallocarray: overflow");
+		abort();
+	}
+
+	size_t old = oldnmemb * size;
+	size_t new = nmemb * size;
+	if (ptr == NULL) {
+		return allocator_alloc(allocator, new);
+	}
+
+	// Like recallocarray(3) the tail is cleared before shrinking
+	// and [old,new) is zeroed after growing whichever path is used.
+	if (new < old) {
+		memset((char *)ptr + new, 0, old - new);
+	}
+
+	void *x;
+	if (allocator->realloc) {
+		x = allocator->realloc(allocator->ctx, ptr, old, new);
+		if (x == NULL) {
+			warn("recallocarray");
+			abort();
+		}
+	} else {
+		x = allocator_alloc_uninit(allocator, new);
+		memcpy(x, ptr, MIN(old, new));
+		allocator->free(allocator->ctx, ptr);
+	}
+	if (new > old) {
+		memset((char *)x + old, 0, new - old);
+	}
+	return x;
+}
+
+void
+allocator_free(const struct Allocator *allocator, void *ptr)
+{
+	if (ptr == NULL) {
+		return;
+	}
+	if (allocator == NULL) {
+		allocator = &allocator_malloc;
+	}
+	allocator->free(allocator->ctx, ptr);
+}
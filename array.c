@@ -28,6 +28,7 @@
 
 #include "config.h"
 
+#include <sys/param.h>
 #include <sys/types.h>
 #include <assert.h>
 #if HAVE_ERR
@@ -36,59 +37,150 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "allocator.h"
 #include "array.h"
 #include "diff.h"
 #include "mempool.h"
 #include "util.h"
 
-struct Array {
-	void **buf;
-	size_t cap;
-	size_t len;
-	size_t value_size;
-};
+static const size_t INITIAL_ARRAY_CAP = 16;
 
-struct ArrayIterator {
-	void **buf;
-	size_t i;
-	size_t len;
-};
+static inline void *
+array_slot(struct Array *array, size_t i)
+{
+	return array->buf + i * array->value_size;
+}
 
-static const size_t INITIAL_ARRAY_CAP = 16;
+static inline void *
+array_value(struct Array *array, size_t i)
+{
+	if (array->inline_values) {
+		return array_slot(array, i);
+	} else {
+		return ((void **)array->buf)[i];
+	}
+}
 
 struct Array *
 array_new(void)
 {
-	struct Array *array = xmalloc(sizeof(struct Array));
+	const struct Allocator *allocator = allocator_current();
+	struct Array *array = allocator_alloc(allocator, sizeof(struct Array));
+	array_init(array);
+	array->allocator = allocator;
+	return array;
+}
+
+struct Array *
+array_new_sized(size_t value_size)
+{
+	const struct Allocator *allocator = allocator_current();
+	struct Array *array = allocator_alloc(allocator, sizeof(struct Array));
+	array_init_sized(array, value_size);
+	array->allocator = allocator;
+	return array;
+}
 
-	array->cap = INITIAL_ARRAY_CAP;
+void
+array_init(struct Array *array)
+{
+	array->buf = NULL;
+	array->cap = 0;
 	array->len = 0;
 	array->value_size = sizeof(void *);
-	array->buf = xrecallocarray(NULL, 0, array->cap, array->value_size);
+	array->inline_values = 0;
+	array->allocator = NULL;
+	array->small = NULL;
+	array->small_size = 0;
+}
 
-	return array;
+// The allocator is picked on the first allocation unless the array
+// was created with array_new().
+void
+array_init_sized(struct Array *array, size_t value_size)
+{
+	assert(value_size > 0);
+	array_init(array);
+	array->value_size = value_size;
+	array->inline_values = 1;
 }
 
+// Frees the heap buffer of the array but not the array itself.  An
+// array from SCOPE_ARRAY goes back to its inline buffer.
 void
-array_append(struct Array *array, const void *v)
+array_finish(struct Array *array)
 {
-	assert(array->cap > 0);
-	assert(array->cap > array->len);
+	if (array->buf != array->small) {
+		allocator_free(array->allocator, array->buf);
+	}
+	array->buf = array->small;
+	array->cap = array->small_size / array->value_size;
+	array->len = 0;
+}
 
-	array->buf[array->len++] = (void *)v;
-	if (array->len >= array->cap) {
-		size_t new_cap = array->cap + INITIAL_ARRAY_CAP;
+static void
+array_resize(struct Array *array, size_t new_cap)
+{
+	assert(new_cap >= array->len);
+	assert(new_cap > 0);
+	if (array->allocator == NULL) {
+		array->allocator = allocator_current();
+	}
+	if (array->buf && array->buf == array->small) {
+		char *buf = allocator_recallocarray(array->allocator, NULL, 0, new_cap, array->value_size);
+		memcpy(buf, array->buf, array->len * array->value_size);
+		array->buf = buf;
+	} else {
+		array->buf = allocator_recallocarray(array->allocator, array->buf, array->cap, new_cap, array->value_size);
+	}
+	array->cap = new_cap;
+}
+
+static void
+array_grow(struct Array *array)
+{
+	if (array->len == array->cap) {
+		size_t new_cap = MAX(array->cap * 2, INITIAL_ARRAY_CAP);
 		assert(new_cap > array->cap);
-		void **new_array = xrecallocarray(array->buf, array->cap, new_cap, array->value_size);
-		array->buf = new_array;
-		array->cap = new_cap;
+		array_resize(array, new_cap);
+	}
+}
+
+void
+array_append(struct Array *array, const void *v)
+{
+	if (array->inline_values) {
+		array_append_value(array, v);
+	} else {
+		array_grow(array);
+		((void **)array->buf)[array->len++] = (void *)v;
 	}
 }
 
+void *
+array_append_value(struct Array *array, const void *v)
+{
+	array_grow(array);
+	void *slot = array_slot(array, array->len++);
+	if (v) {
+		memcpy(slot, v, array->value_size);
+	} else {
+		memset(slot, 0, array->value_size);
+	}
+	return slot;
+}
+
+size_t
+array_capacity(struct Array *array)
+{
+	return array->cap;
+}
+
 struct diff *
 array_diff(struct Array *base1, struct Array *base2, struct Mempool *pool, ArrayCompareFn cmp, void *userdata)
 {
 	assert(base1->value_size == base2->value_size);
+	assert(base1->inline_values == base2->inline_values);
 	struct diff *d = xmalloc(sizeof(struct diff));
 	int retval = diff(d, cmp, userdata, base1->value_size,
 			  base1->buf, base1->len, base2->buf, base2->len);
@@ -111,23 +203,34 @@ array_free(struct Array *array)
 	if (array == NULL) {
 		return;
 	}
-	free(array->buf);
-	free(array);
+	array_finish(array);
+	allocator_free(array->allocator, array);
 }
 
 ssize_t
 array_find(struct Array *array, const void *k, ArrayCompareFn compar, void *userdata)
 {
-	if (compar) {
+	if (array->inline_values) {
 		for (size_t i = 0; i < array->len; i++) {
-			const void *v = array->buf[i];
+			const void *v = array_slot(array, i);
+			if (compar) {
+				if (compar(v, k, userdata) == 0) {
+					return i;
+				}
+			} else if (memcmp(v, k, array->value_size) == 0) {
+				return i;
+			}
+		}
+	} else if (compar) {
+		for (size_t i = 0; i < array->len; i++) {
+			const void *v = array_value(array, i);
 			if (compar(&v, &k, userdata) == 0) {
 				return i;
 			}
 		}
 	} else {
 		for (size_t i = 0; i < array->len; i++) {
-			if (array->buf[i] == k) {
+			if (array_value(array, i) == k) {
 				return i;
 			}
 		}
@@ -139,7 +242,16 @@ void *
 array_get(struct Array *array, size_t i)
 {
 	if (i < array->len) {
-		return array->buf[i];
+		return array_value(array, i);
+	}
+	return NULL;
+}
+
+void *
+array_get_ptr(struct Array *array, size_t i)
+{
+	if (i < array->len) {
+		return array_slot(array, i);
 	}
 	return NULL;
 }
@@ -155,16 +267,41 @@ array_pop(struct Array *array)
 {
 	if (array->len > 0) {
 		array->len--;
-		return array->buf[array->len];
+		return array_value(array, array->len);
 	}
 	return NULL;
 }
 
+void
+array_reserve(struct Array *array, size_t cap)
+{
+	if (cap > array->cap) {
+		array_resize(array, cap);
+	}
+}
+
 void
 array_set(struct Array *array, size_t i, const void *v)
 {
 	if (i < array->len) {
-		array->buf[i] = (void *)v;
+		if (array->inline_values) {
+			if (v) {
+				memcpy(array_slot(array, i), v, array->value_size);
+			} else {
+				memset(array_slot(array, i), 0, array->value_size);
+			}
+		} else {
+			((void **)array->buf)[i] = (void *)v;
+		}
+	}
+}
+
+void
+array_shrink_to_fit(struct Array *array)
+{
+	size_t new_cap = MAX(array->len, 1);
+	if (new_cap < array->cap && array->buf != array->small) {
+		array_resize(array, new_cap);
 	}
 }
 
@@ -188,35 +325,22 @@ array_truncate_at(struct Array *array, size_t len)
 	}
 }
 
-struct ArrayIterator *
+struct ArrayIterator
 array_iterator(struct Array *array, ssize_t a, ssize_t b)
 {
-	struct ArrayIterator *iter = xmalloc(sizeof(struct ArrayIterator));
-	iter->buf = array->buf;
-	slice_to_range(array->len, a, b, &iter->i, &iter->len);
+	struct ArrayIterator iter = { .array = array };
+	slice_to_range(array->len, a, b, &iter.i, &iter.len);
 	return iter;
 }
 
-void
-array_iterator_free(struct ArrayIterator **iter_)
-{
-	struct ArrayIterator *iter = *iter_;
-	if (iter != NULL) {
-		free(iter);
-		*iter_ = NULL;
-	}
-}
-
 void *
-array_iterator_next(struct ArrayIterator **iter_, size_t *index)
+array_iterator_next(struct ArrayIterator *iter, size_t *index)
 {
-	struct ArrayIterator *iter = *iter_;
 	if (iter->i < iter->len) {
 		*index = iter->i;
-		return iter->buf[iter->i++];
+		return array_value(iter->array, iter->i++);
 	} else {
-		array_iterator_free(iter_);
-		*iter_ = NULL;
+		iter->array = NULL;
 		return NULL;
 	}
 }
@@ -27,33 +27,67 @@
  */
 #pragma once
 
-struct Array;
-struct ArrayIterator;
+struct Allocator;
 struct diff;
 struct Mempool;
 typedef int (*ArrayCompareFn)(const void *, const void *, void *);
 
+#define ARRAY_INLINE_CAP 8
+
+struct Array {
+	char *buf;
+	size_t cap;
+	size_t len;
+	size_t value_size;
+	int inline_values;
+	const struct Allocator *allocator;
+	void *small;
+	size_t small_size;
+};
+
+// Arrays declared with SCOPE_ARRAY use a buffer on the C stack for
+// their first ARRAY_INLINE_CAP elements and only allocate when they
+// outgrow it.  ARRAY_INITIALIZER takes any void *[] as that buffer.
+#define ARRAY_INITIALIZER(storage) { .buf = (char *)(storage), .cap = sizeof(storage) / sizeof(void *), .value_size = sizeof(void *), .small = (storage), .small_size = sizeof(storage) }
+#define SCOPE_ARRAY(x) \
+	void *x##_storage[ARRAY_INLINE_CAP]; \
+	struct Array x __cleanup(array_finish) = ARRAY_INITIALIZER(x##_storage)
+
 struct Array *array_new(void);
+struct Array *array_new_sized(size_t);
+void array_init(struct Array *);
+void array_init_sized(struct Array *, size_t);
+void array_finish(struct Array *);
 void array_append(struct Array *, const void *);
+void *array_append_value(struct Array *, const void *);
+size_t array_capacity(struct Array *);
 struct diff *array_diff(struct Array *, struct Array *, struct Mempool *, ArrayCompareFn, void *);
 void array_free(struct Array *);
 void *array_get(struct Array *, size_t);
+void *array_get_ptr(struct Array *, size_t);
 ssize_t array_find(struct Array *, const void *, ArrayCompareFn, void *);
 size_t array_len(struct Array *);
 void *array_pop(struct Array *);
+void array_reserve(struct Array *, size_t);
 void array_set(struct Array *, size_t, const void *);
+void array_shrink_to_fit(struct Array *);
 void array_sort(struct Array *, ArrayCompareFn, void *);
 void array_truncate(struct Array *);
 void array_truncate_at(struct Array *array, size_t);
 
-struct ArrayIterator *array_iterator(struct Array *, ssize_t, ssize_t);
-void array_iterator_free(struct ArrayIterator **);
-void *array_iterator_next(struct ArrayIterator **, size_t *);
+struct ArrayIterator {
+	struct Array *array;
+	size_t i;
+	size_t len;
+};
+
+struct ArrayIterator array_iterator(struct Array *, ssize_t, ssize_t);
+void *array_iterator_next(struct ArrayIterator *, size_t *);
 
 #define ARRAY_FOREACH_SLICE(ARRAY, A, B, TYPE, VAR) \
-	for (struct ArrayIterator *__##VAR##_iter __cleanup(array_iterator_free) = array_iterator((ARRAY), A, B); __##VAR##_iter != NULL; array_iterator_free(&__##VAR##_iter)) \
-	for (size_t VAR##_index = 0; __##VAR##_iter != NULL; array_iterator_free(&__##VAR##_iter)) \
-	for (TYPE VAR = array_iterator_next(&__##VAR##_iter, &VAR##_index); __##VAR##_iter != NULL; VAR = array_iterator_next(&__##VAR##_iter, &VAR##_index))
+	for (struct ArrayIterator __##VAR##_iter = array_iterator((ARRAY), A, B); __##VAR##_iter.array != NULL; __##VAR##_iter.array = NULL) \
+	for (size_t VAR##_index = 0; __##VAR##_iter.array != NULL; __##VAR##_iter.array = NULL) \
+	for (TYPE VAR = array_iterator_next(&__##VAR##_iter, &VAR##_index); __##VAR##_iter.array != NULL; VAR = array_iterator_next(&__##VAR##_iter, &VAR##_index))
 
 #define ARRAY_FOREACH(ARRAY, TYPE, VAR) \
 	ARRAY_FOREACH_SLICE(ARRAY, 0, -1, TYPE, VAR)
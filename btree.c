@@ -0,0 +1,548 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2020 Tobias Kortkamp <tobik@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "array.h"
+#include "btree.h"
+
+static void btree_insert_separator(struct BTree *, struct BTreeNode **, size_t *, size_t, struct BTreeNode *, void *, struct BTreeNode *);
+static struct BTreeNode *btree_node_new(struct BTree *, int);
+static void btree_node_free(struct BTree *, struct BTreeNode *, void (*)(void *), void (*)(void *));
+static void btree_rebalance(struct BTree *, struct BTreeNode *, size_t);
+static size_t btree_search(struct BTree *, struct BTreeNode *, const void *, int);
+
+void
+btree_init(struct BTree *tree, BTreeCompareFn compare, void *compare_userdata, const struct Allocator *allocator, int values)
+{
+	tree->root = NULL;
+	tree->len = 0;
+	tree->compare = compare;
+	tree->compare_userdata = compare_userdata;
+	tree->allocator = allocator;
+	tree->values = values;
+}
+
+struct BTreeNode *
+btree_node_new(struct BTree *tree, int leaf)
+{
+	struct BTreeNode *node;
+	if (leaf && !tree->values) {
+		node = allocator_alloc(tree->allocator, offsetof(struct BTreeNode, values));
+	} else {
+		node = allocator_alloc(tree->allocator, sizeof(struct BTreeNode));
+	}
+	node->leaf = leaf;
+	return node;
+}
+
+void
+btree_node_free(struct BTree *tree, struct BTreeNode *node, void (*keyfree)(void *), void (*valuefree)(void *))
+{
+	if (node->leaf) {
+		for (size_t i = 0; i < node->len; i++) {
+			if (keyfree) {
+				keyfree(node->keys[i]);
+			}
+			if (valuefree) {
+				valuefree(node->values[i]);
+			}
+		}
+	} else {
+		for (size_t i = 0; i <= node->len; i++) {
+			btree_node_free(tree, node->children[i], keyfree, valuefree);
+		}
+	}
+	allocator_free(tree->allocator, node);
+}
+
+int
+btree_compare(struct BTree *tree, const void *a, const void *b)
+{
+	if (tree->compare) {
+		return tree->compare(&a, &b, tree->compare_userdata);
+	} else if (a == b) {
+		return 0;
+	} else if (a < b) {
+		return -1;
+	} else {
+		return 1;
+	}
+}
+
+// Returns the number of keys in the node that are less than key or,
+// if upper is set, less than or equal to key.
+size_t
+btree_search(struct BTree *tree, struct BTreeNode *node, const void *key, int upper)
+{
+	size_t lo = 0;
+	size_t hi = node->len;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = btree_compare(tree, node->keys[mid], key);
+		if (cmp < 0 || (upper && cmp == 0)) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// Fills an empty tree from keys sorted in ascending order and the
+// values at the same indices.  Keys that compare equal to the one
+// before them are skipped and passed to keyfree and valuefree.  Keys
+// are spread evenly over the leaves and children over the inner nodes,
+// so that no node but the root holds less than BTREE_MIN keys.
+// Returns 0 without changing the tree if the keys are out of order.
+int
+btree_build(struct BTree *tree, struct Array *keys, struct Array *values, void (*keyfree)(void *), void (*valuefree)(void *))
+{
+	size_t len = array_len(keys);
+	size_t unique = 0;
+	for (size_t i = 0; i < len; i++) {
+		if (i > 0) {
+			int cmp = btree_compare(tree, array_get(keys, i - 1), array_get(keys, i));
+			if (cmp > 0) {
+				return 0;
+			} else if (cmp == 0) {
+				continue;
+			}
+		}
+		unique++;
+	}
+	if (unique == 0) {
+		return 1;
+	}
+
+	size_t cap = (unique + BTREE_ORDER - 1) / BTREE_ORDER;
+	struct BTreeNode **level = allocator_recallocarray(tree->allocator, NULL, 0, cap, sizeof(struct BTreeNode *));
+	void **mins = allocator_recallocarray(tree->allocator, NULL, 0, cap, sizeof(void *));
+	size_t nodes = 0;
+	struct BTreeNode *leaf = NULL;
+	for (size_t i = 0; i < len; i++) {
+		void *key = array_get(keys, i);
+		void *value = values ? array_get(values, i) : NULL;
+		if (leaf && btree_compare(tree, leaf->keys[leaf->len - 1], key) == 0) {
+			// The same pointer might be repeated
+			if (keyfree && key != leaf->keys[leaf->len - 1]) {
+				keyfree(key);
+			}
+			if (valuefree && values && value != leaf->values[leaf->len - 1]) {
+				valuefree(value);
+			}
+			continue;
+		}
+		if (leaf == NULL || leaf->len == unique / cap + (nodes - 1 < unique % cap)) {
+			struct BTreeNode *next = btree_node_new(tree, 1);
+			if (leaf) {
+				leaf->next = next;
+				next->prev = leaf;
+			}
+			leaf = next;
+			level[nodes] = leaf;
+			mins[nodes++] = key;
+		}
+		leaf->keys[leaf->len] = key;
+		if (tree->values) {
+			leaf->values[leaf->len] = value;
+		}
+		leaf->len++;
+		tree->len++;
+	}
+
+	// Build the inner levels bottom up.  The separator of a child is
+	// the smallest key of its subtree.
+	while (nodes > 1) {
+		size_t parents = (nodes + BTREE_ORDER) / (BTREE_ORDER + 1);
+		size_t child = 0;
+		for (size_t i = 0; i < parents; i++) {
+			struct BTreeNode *parent = btree_node_new(tree, 0);
+			size_t n = nodes / parents + (i < nodes % parents);
+			for (size_t j = 0; j < n; j++) {
+				parent->children[j] = level[child + j];
+				if (j > 0) {
+					parent->keys[j - 1] = mins[child + j];
+				}
+			}
+			parent->len = n - 1;
+			level[i] = parent;
+			mins[i] = mins[child];
+			child += n;
+		}
+		nodes = parents;
+	}
+	tree->root = level[0];
+
+	allocator_free(tree->allocator, level);
+	allocator_free(tree->allocator, mins);
+	return 1;
+}
+
+struct BTreeNode *
+btree_find(struct BTree *tree, const void *key, size_t *index)
+{
+	struct BTreeNode *node = tree->root;
+	if (node == NULL) {
+		return NULL;
+	}
+	while (!node->leaf) {
+		node = node->children[btree_search(tree, node, key, 1)];
+	}
+	size_t i = btree_search(tree, node, key, 0);
+	if (i < node->len && btree_compare(tree, node->keys[i], key) == 0) {
+		*index = i;
+		return node;
+	}
+	return NULL;
+}
+
+// Returns the leftmost leaf
+struct BTreeNode *
+btree_first(struct BTree *tree)
+{
+	struct BTreeNode *node = tree->root;
+	if (node) {
+		while (!node->leaf) {
+			node = node->children[0];
+		}
+	}
+	return node;
+}
+
+// Returns the leaf and slot of the first key that is not less than
+// key or, if upper is set, greater than key.
+struct BTreeNode *
+btree_bound(struct BTree *tree, const void *key, int upper, size_t *index)
+{
+	struct BTreeNode *node = tree->root;
+	if (node == NULL) {
+		return NULL;
+	}
+	while (!node->leaf) {
+		node = node->children[btree_search(tree, node, key, 1)];
+	}
+	*index = btree_search(tree, node, key, upper);
+	if (*index == node->len) {
+		*index = 0;
+		return node->next;
+	}
+	return node;
+}
+
+// Inserts the separator key and the new right sibling of the child
+// at path[depth - 1] into its parent, splitting inner nodes up to the
+// root as needed.
+void
+btree_insert_separator(struct BTree *tree, struct BTreeNode **path, size_t *pathidx, size_t depth, struct BTreeNode *left, void *key, struct BTreeNode *right)
+{
+	while (depth > 0) {
+		struct BTreeNode *parent = path[--depth];
+		size_t pos = pathidx[depth];
+		if (parent->len < BTREE_ORDER) {
+			memmove(&parent->keys[pos + 1], &parent->keys[pos], (parent->len - pos) * sizeof(void *));
+			memmove(&parent->children[pos + 2], &parent->children[pos + 1], (parent->len - pos) * sizeof(struct BTreeNode *));
+			parent->keys[pos] = key;
+			parent->children[pos + 1] = right;
+			parent->len++;
+			return;
+		}
+
+		void *keys[BTREE_ORDER + 1];
+		struct BTreeNode *children[BTREE_ORDER + 2];
+		memcpy(keys, parent->keys, pos * sizeof(void *));
+		keys[pos] = key;
+		memcpy(&keys[pos + 1], &parent->keys[pos], (BTREE_ORDER - pos) * sizeof(void *));
+		memcpy(children, parent->children, (pos + 1) * sizeof(struct BTreeNode *));
+		children[pos + 1] = right;
+		memcpy(&children[pos + 2], &parent->children[pos + 1], (BTREE_ORDER - pos) * sizeof(struct BTreeNode *));
+
+		// The middle key moves up into the grandparent
+		size_t mid = (BTREE_ORDER + 1) / 2;
+		struct BTreeNode *sibling = btree_node_new(tree, 0);
+		parent->len = mid;
+		memcpy(parent->keys, keys, mid * sizeof(void *));
+		memcpy(parent->children, children, (mid + 1) * sizeof(struct BTreeNode *));
+		sibling->len = BTREE_ORDER - mid;
+		memcpy(sibling->keys, &keys[mid + 1], sibling->len * sizeof(void *));
+		memcpy(sibling->children, &children[mid + 1], (sibling->len + 1) * sizeof(struct BTreeNode *));
+
+		left = parent;
+		key = keys[mid];
+		right = sibling;
+	}
+
+	struct BTreeNode *root = btree_node_new(tree, 0);
+	root->len = 1;
+	root->keys[0] = key;
+	root->children[0] = left;
+	root->children[1] = right;
+	tree->root = root;
+}
+
+// Returns the leaf and slot of key.  If the key is not in the tree
+// yet it is inserted with a NULL value and *inserted is set.
+struct BTreeNode *
+btree_insert(struct BTree *tree, const void *key, size_t *index, int *inserted)
+{
+	if (tree->root == NULL) {
+		tree->root = btree_node_new(tree, 1);
+	}
+
+	struct BTreeNode *path[BTREE_MAX_DEPTH];
+	size_t pathidx[BTREE_MAX_DEPTH];
+	size_t depth = 0;
+	struct BTreeNode *node = tree->root;
+	while (!node->leaf) {
+		assert(depth < BTREE_MAX_DEPTH);
+		size_t i = btree_search(tree, node, key, 1);
+		path[depth] = node;
+		pathidx[depth++] = i;
+		node = node->children[i];
+	}
+
+	size_t i = btree_search(tree, node, key, 0);
+	if (i < node->len && btree_compare(tree, node->keys[i], key) == 0) {
+		*index = i;
+		*inserted = 0;
+		return node;
+	}
+
+	if (node->len == BTREE_ORDER) {
+		size_t mid = BTREE_ORDER / 2;
+		struct BTreeNode *right = btree_node_new(tree, 1);
+		right->len = BTREE_ORDER - mid;
+		memcpy(right->keys, &node->keys[mid], right->len * sizeof(void *));
+		if (tree->values) {
+			memcpy(right->values, &node->values[mid], right->len * sizeof(void *));
+		}
+		node->len = mid;
+		right->prev = node;
+		right->next = node->next;
+		if (right->next) {
+			right->next->prev = right;
+		}
+		node->next = right;
+		btree_insert_separator(tree, path, pathidx, depth, node, right->keys[0], right);
+		// A key that sorts before the separator must stay left
+		if (i > mid) {
+			node = right;
+			i -= mid;
+		}
+	}
+
+	memmove(&node->keys[i + 1], &node->keys[i], (node->len - i) * sizeof(void *));
+	node->keys[i] = (void *)key;
+	if (tree->values) {
+		memmove(&node->values[i + 1], &node->values[i], (node->len - i) * sizeof(void *));
+		node->values[i] = NULL;
+	}
+	node->len++;
+	tree->len++;
+	*index = i;
+	*inserted = 1;
+	return node;
+}
+
+// Separators are borrowed key pointers.  When a key is replaced by an
+// equal one, the separator that might still point at it is replaced by
+// newkey.
+void
+btree_replace_separator(struct BTree *tree, const void *oldkey, void *newkey)
+{
+	struct BTreeNode *node = tree->root;
+	while (node && !node->leaf) {
+		size_t i = btree_search(tree, node, oldkey, 1);
+		if (i > 0 && node->keys[i - 1] == oldkey) {
+			node->keys[i - 1] = newkey;
+			return;
+		}
+		node = node->children[i];
+	}
+}
+
+// Refills the underfull child at pos of parent by borrowing from a
+// sibling with keys to spare, or merges it with one.  Separators stay
+// the smallest key of the subtree to their right.
+void
+btree_rebalance(struct BTree *tree, struct BTreeNode *parent, size_t pos)
+{
+	struct BTreeNode *node = parent->children[pos];
+	struct BTreeNode *left = pos > 0 ? parent->children[pos - 1] : NULL;
+	struct BTreeNode *right = pos < parent->len ? parent->children[pos + 1] : NULL;
+
+	if (left && left->len > BTREE_MIN) {
+		memmove(&node->keys[1], &node->keys[0], node->len * sizeof(void *));
+		if (node->leaf) {
+			node->keys[0] = left->keys[left->len - 1];
+			if (tree->values) {
+				memmove(&node->values[1], &node->values[0], node->len * sizeof(void *));
+				node->values[0] = left->values[left->len - 1];
+			}
+			parent->keys[pos - 1] = node->keys[0];
+		} else {
+			memmove(&node->children[1], &node->children[0], (node->len + 1) * sizeof(struct BTreeNode *));
+			node->keys[0] = parent->keys[pos - 1];
+			node->children[0] = left->children[left->len];
+			parent->keys[pos - 1] = left->keys[left->len - 1];
+		}
+		node->len++;
+		left->len--;
+		return;
+	}
+
+	if (right && right->len > BTREE_MIN) {
+		if (node->leaf) {
+			node->keys[node->len] = right->keys[0];
+			memmove(&right->keys[0], &right->keys[1], (right->len - 1) * sizeof(void *));
+			if (tree->values) {
+				node->values[node->len] = right->values[0];
+				memmove(&right->values[0], &right->values[1], (right->len - 1) * sizeof(void *));
+			}
+			parent->keys[pos] = right->keys[0];
+		} else {
+			node->keys[node->len] = parent->keys[pos];
+			node->children[node->len + 1] = right->children[0];
+			parent->keys[pos] = right->keys[0];
+			memmove(&right->keys[0], &right->keys[1], (right->len - 1) * sizeof(void *));
+			memmove(&right->children[0], &right->children[1], right->len * sizeof(struct BTreeNode *));
+		}
+		node->len++;
+		right->len--;
+		return;
+	}
+
+	// Neither sibling can spare a key, so together with one of them
+	// the node fits into a single node.  Merge into the left one.
+	if (left == NULL) {
+		left = node;
+		node = right;
+		pos++;
+	}
+	if (node->leaf) {
+		memcpy(&left->keys[left->len], node->keys, node->len * sizeof(void *));
+		if (tree->values) {
+			memcpy(&left->values[left->len], node->values, node->len * sizeof(void *));
+		}
+		left->len += node->len;
+		left->next = node->next;
+		if (left->next) {
+			left->next->prev = left;
+		}
+	} else {
+		left->keys[left->len] = parent->keys[pos - 1];
+		memcpy(&left->keys[left->len + 1], node->keys, node->len * sizeof(void *));
+		memcpy(&left->children[left->len + 1], node->children, (node->len + 1) * sizeof(struct BTreeNode *));
+		left->len += node->len + 1;
+	}
+	memmove(&parent->keys[pos - 1], &parent->keys[pos], (parent->len - pos) * sizeof(void *));
+	memmove(&parent->children[pos], &parent->children[pos + 1], (parent->len - pos) * sizeof(struct BTreeNode *));
+	parent->len--;
+	allocator_free(tree->allocator, node);
+}
+
+// Removes key from the tree and returns 1 if it was found.  The
+// removed key and value are returned through oldkey and oldvalue so
+// that the caller can free them.
+int
+btree_remove(struct BTree *tree, const void *key, void **oldkey, void **oldvalue)
+{
+	struct BTreeNode *path[BTREE_MAX_DEPTH];
+	size_t pathidx[BTREE_MAX_DEPTH];
+	size_t depth = 0;
+	struct BTreeNode *node = tree->root;
+	if (node == NULL) {
+		return 0;
+	}
+	while (!node->leaf) {
+		size_t i = btree_search(tree, node, key, 1);
+		path[depth] = node;
+		pathidx[depth++] = i;
+		node = node->children[i];
+	}
+
+	size_t i = btree_search(tree, node, key, 0);
+	if (i == node->len || btree_compare(tree, node->keys[i], key) != 0) {
+		return 0;
+	}
+
+	*oldkey = node->keys[i];
+	memmove(&node->keys[i], &node->keys[i + 1], (node->len - i - 1) * sizeof(void *));
+	if (tree->values) {
+		*oldvalue = node->values[i];
+		memmove(&node->values[i], &node->values[i + 1], (node->len - i - 1) * sizeof(void *));
+	} else {
+		*oldvalue = NULL;
+	}
+	node->len--;
+	tree->len--;
+
+	// The separator that pointed at the smallest key of the leaf now
+	// has to point at its successor.  It sits in the deepest ancestor
+	// where the leaf is not in the leftmost subtree.
+	if (i == 0 && node->len > 0) {
+		for (size_t d = depth; d > 0; d--) {
+			if (pathidx[d - 1] > 0) {
+				path[d - 1]->keys[pathidx[d - 1] - 1] = node->keys[0];
+				break;
+			}
+		}
+	}
+
+	// Rebalance underfull nodes up to the root and drop a root that is
+	// left without keys.
+	while (depth > 0 && node->len < BTREE_MIN) {
+		struct BTreeNode *parent = path[--depth];
+		btree_rebalance(tree, parent, pathidx[depth]);
+		node = parent;
+	}
+	if (tree->root->len == 0) {
+		struct BTreeNode *root = tree->root;
+		tree->root = root->leaf ? NULL : root->children[0];
+		allocator_free(tree->allocator, root);
+	}
+	return 1;
+}
+
+// Frees all nodes.  The keys and values are passed to keyfree and
+// valuefree if they are not NULL.
+void
+btree_truncate(struct BTree *tree, void (*keyfree)(void *), void (*valuefree)(void *))
+{
+	if (tree->root) {
+		btree_node_free(tree, tree->root, keyfree, valuefree);
+		tree->root = NULL;
+	}
+	tree->len = 0;
+}
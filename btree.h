@@ -0,0 +1,74 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2020 Tobias Kortkamp <tobik@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#pragma once
+
+struct Allocator;
+struct Array;
+
+typedef int (*BTreeCompareFn)(const void *, const void *, void *);
+
+// B+tree used by the ordered maps and by sets.  Only leaves hold
+// values and they are linked for in-order iteration.  Inner nodes hold
+// len separator keys and len + 1 children.  A separator is the smallest
+// key of the subtree to its right.  All nodes but the root hold at
+// least BTREE_MIN keys.  Trees without values allocate their leaves
+// without the values array.
+#define BTREE_ORDER 32
+#define BTREE_MIN (BTREE_ORDER / 2)
+#define BTREE_MAX_DEPTH 32
+struct BTreeNode {
+	size_t len;
+	int leaf;
+	struct BTreeNode *prev;
+	struct BTreeNode *next;
+	void *keys[BTREE_ORDER];
+	union {
+		void *values[BTREE_ORDER];
+		struct BTreeNode *children[BTREE_ORDER + 1];
+	};
+};
+
+struct BTree {
+	struct BTreeNode *root;
+	size_t len;
+	BTreeCompareFn compare;
+	void *compare_userdata;
+	const struct Allocator *allocator;
+	int values;
+};
+
+void btree_init(struct BTree *, BTreeCompareFn, void *, const struct Allocator *, int);
+int btree_build(struct BTree *, struct Array *, struct Array *, void (*)(void *), void (*)(void *));
+int btree_compare(struct BTree *, const void *, const void *);
+struct BTreeNode *btree_find(struct BTree *, const void *, size_t *);
+struct BTreeNode *btree_first(struct BTree *);
+struct BTreeNode *btree_bound(struct BTree *, const void *, int, size_t *);
+struct BTreeNode *btree_insert(struct BTree *, const void *, size_t *, int *);
+int btree_remove(struct BTree *, const void *, void **, void **);
+void btree_replace_separator(struct BTree *, const void *, void *);
+void btree_truncate(struct BTree *, void (*)(void *), void (*)(void *));
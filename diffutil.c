@@ -48,8 +48,8 @@ struct Hunk {
 static int
 by_start(const void *ap, const void *bp, void *userdata)
 {
-	struct Hunk *a = *(struct Hunk **)ap;
-	struct Hunk *b = *(struct Hunk **)bp;
+	const struct Hunk *a = ap;
+	const struct Hunk *b = bp;
 	if (a->start < b->start) {
 		return -1;
 	} else if (a->start > b->start) {
@@ -64,24 +64,21 @@ get_hunks(struct Mempool *pool, struct diff *p, size_t context)
 {
 	assert(p->sessz > 0);
 	if (context == 0) {
-		struct Array *hunks = mempool_array(pool);
-		struct Hunk *h = mempool_alloc(pool, sizeof(struct Hunk));
-		h->start = 0;
-		h->end = p->sessz - 1;
-		array_append(hunks, h);
+		struct Array *hunks = mempool_array_sized(pool, sizeof(struct Hunk));
+		struct Hunk hunk = { .start = 0, .end = p->sessz - 1 };
+		array_append(hunks, &hunk);
 		return hunks;
 	}
 
-	struct Array *edit_ranges = mempool_array(pool);
-	struct Hunk *h = mempool_alloc(pool, sizeof(struct Hunk));
+	struct Array *edit_ranges = mempool_array_sized(pool, sizeof(struct Hunk));
+	struct Hunk hunk = { 0 };
 	int first = 1;
 	int last_common = 1;
 	for (size_t i = 0; i < p->sessz; i++) {
 		switch (p->ses[i].type) {
 		case DIFF_COMMON:
 			if (!last_common) {
-				array_append(edit_ranges, h);
-				h = mempool_alloc(pool, sizeof(struct Hunk));
+				array_append(edit_ranges, &hunk);
 			}
 			last_common = 1;
 			first = 1;
@@ -90,15 +87,15 @@ get_hunks(struct Mempool *pool, struct diff *p, size_t context)
 		case DIFF_DELETE:
 			last_common = 0;
 			if (first) {
-				h->start = i;
+				hunk.start = i;
 				first = 0;
 			}
-			h->end = i;
+			hunk.end = i;
 			break;
 		}
 	}
 	if (!first) {
-		array_append(edit_ranges, h);
+		array_append(edit_ranges, &hunk);
 	}
 
 	ARRAY_FOREACH(edit_ranges, struct Hunk *, h) {
@@ -109,7 +106,7 @@ get_hunks(struct Mempool *pool, struct diff *p, size_t context)
 	}
 	array_sort(edit_ranges, by_start, NULL);
 
-	struct Array *hunks = mempool_array(pool);
+	struct Array *hunks = mempool_array_sized(pool, sizeof(struct Hunk));
 	struct Hunk *last = NULL;
 	ARRAY_FOREACH(edit_ranges, struct Hunk *, h) {
 		if (last == NULL) {
@@ -0,0 +1,277 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2020 Tobias Kortkamp <tobik@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "allocator.h"
+#include "array.h"
+#include "heap.h"
+#include "util.h"
+
+// Array backed d-ary min-heap.  Every element gets a handle when it
+// is pushed.  pos maps handles to the element's index in entries so
+// that heap_update() and heap_remove() can find it.  Handles of removed
+// elements are chained through pos and reused.
+
+struct HeapEntry {
+	void *value;
+	size_t handle;
+};
+
+struct Heap {
+	struct HeapEntry *entries;
+	size_t len;
+	size_t cap;
+	size_t *pos;
+	size_t handles;
+	size_t freelist;
+	ArrayCompareFn compare;
+	void *compare_userdata;
+	const struct Allocator *allocator;
+};
+
+#define HEAP_ARITY 4
+static const size_t HEAP_NO_HANDLE = SIZE_MAX;
+static const size_t INITIAL_HEAP_CAP = 16;
+
+static int heap_compare(struct Heap *, struct HeapEntry *, struct HeapEntry *);
+static void heap_heapify(struct Heap *);
+static void heap_reserve(struct Heap *, size_t);
+static void heap_sift_down(struct Heap *, size_t);
+static void heap_sift_up(struct Heap *, size_t);
+
+struct Heap *
+heap_new(ArrayCompareFn compare, void *compare_userdata)
+{
+	const struct Allocator *allocator = allocator_current();
+	struct Heap *heap = allocator_alloc(allocator, sizeof(struct Heap));
+	heap->allocator = allocator;
+	heap->freelist = HEAP_NO_HANDLE;
+	heap->compare = compare;
+	heap->compare_userdata = compare_userdata;
+	return heap;
+}
+
+struct Heap *
+heap_from_array(struct Array *array, ArrayCompareFn compare, void *compare_userdata)
+{
+	struct Heap *heap = heap_new(compare, compare_userdata);
+	size_t len = array_len(array);
+	heap_reserve(heap, len);
+	for (size_t i = 0; i < len; i++) {
+		heap->entries[i].value = array_get(array, i);
+		heap->entries[i].handle = i;
+		heap->pos[i] = i;
+	}
+	heap->len = len;
+	heap->handles = len;
+	heap_heapify(heap);
+	return heap;
+}
+
+void
+heap_free(struct Heap *heap)
+{
+	if (heap == NULL) {
+		return;
+	}
+
+	allocator_free(heap->allocator, heap->entries);
+	allocator_free(heap->allocator, heap->pos);
+	allocator_free(heap->allocator, heap);
+}
+
+int
+heap_compare(struct Heap *heap, struct HeapEntry *a, struct HeapEntry *b)
+{
+	return heap->compare(&a->value, &b->value, heap->compare_userdata);
+}
+
+void
+heap_reserve(struct Heap *heap, size_t cap)
+{
+	if (cap <= heap->cap) {
+		return;
+	}
+	heap->entries = allocator_recallocarray(heap->allocator, heap->entries, heap->cap, cap, sizeof(struct HeapEntry));
+	heap->pos = allocator_recallocarray(heap->allocator, heap->pos, heap->cap, cap, sizeof(size_t));
+	heap->cap = cap;
+}
+
+void
+heap_sift_up(struct Heap *heap, size_t i)
+{
+	struct HeapEntry entry = heap->entries[i];
+	while (i > 0) {
+		size_t parent = (i - 1) / HEAP_ARITY;
+		if (heap_compare(heap, &entry, &heap->entries[parent]) >= 0) {
+			break;
+		}
+		heap->entries[i] = heap->entries[parent];
+		heap->pos[heap->entries[i].handle] = i;
+		i = parent;
+	}
+	heap->entries[i] = entry;
+	heap->pos[entry.handle] = i;
+}
+
+void
+heap_sift_down(struct Heap *heap, size_t i)
+{
+	struct HeapEntry entry = heap->entries[i];
+	for (;;) {
+		size_t first = i * HEAP_ARITY + 1;
+		if (first >= heap->len) {
+			break;
+		}
+		size_t last = first + HEAP_ARITY;
+		if (last > heap->len) {
+			last = heap->len;
+		}
+		size_t child = first;
+		for (size_t j = first + 1; j < last; j++) {
+			if (heap_compare(heap, &heap->entries[j], &heap->entries[child]) < 0) {
+				child = j;
+			}
+		}
+		if (heap_compare(heap, &heap->entries[child], &entry) >= 0) {
+			break;
+		}
+		heap->entries[i] = heap->entries[child];
+		heap->pos[heap->entries[i].handle] = i;
+		i = child;
+	}
+	heap->entries[i] = entry;
+	heap->pos[entry.handle] = i;
+}
+
+// Floyd's bottom-up construction in O(n)
+void
+heap_heapify(struct Heap *heap)
+{
+	if (heap->len < 2) {
+		return;
+	}
+	for (size_t i = (heap->len - 2) / HEAP_ARITY + 1; i > 0; i--) {
+		heap_sift_down(heap, i - 1);
+	}
+}
+
+size_t
+heap_len(struct Heap *heap)
+{
+	return heap->len;
+}
+
+void *
+heap_get(struct Heap *heap, size_t handle)
+{
+	return heap->entries[heap->pos[handle]].value;
+}
+
+void *
+heap_peek(struct Heap *heap)
+{
+	if (heap->len > 0) {
+		return heap->entries[0].value;
+	} else {
+		return NULL;
+	}
+}
+
+void *
+heap_pop(struct Heap *heap)
+{
+	if (heap->len > 0) {
+		return heap_remove(heap, heap->entries[0].handle);
+	} else {
+		return NULL;
+	}
+}
+
+size_t
+heap_push(struct Heap *heap, const void *value)
+{
+	size_t handle;
+	if (heap->freelist != HEAP_NO_HANDLE) {
+		handle = heap->freelist;
+		heap->freelist = heap->pos[handle];
+	} else {
+		// There are never more handles than entries
+		if (heap->handles == heap->cap) {
+			heap_reserve(heap, heap->cap ? heap->cap * 2 : INITIAL_HEAP_CAP);
+		}
+		handle = heap->handles++;
+	}
+
+	size_t i = heap->len++;
+	heap->entries[i].value = (void *)value;
+	heap->entries[i].handle = handle;
+	heap_sift_up(heap, i);
+	return handle;
+}
+
+void *
+heap_remove(struct Heap *heap, size_t handle)
+{
+	size_t i = heap->pos[handle];
+	void *value = heap->entries[i].value;
+	heap->pos[handle] = heap->freelist;
+	heap->freelist = handle;
+
+	heap->len--;
+	if (i < heap->len) {
+		heap->entries[i] = heap->entries[heap->len];
+		heap->pos[heap->entries[i].handle] = i;
+		heap_update(heap, heap->entries[i].handle);
+	}
+	return value;
+}
+
+// Restores the heap order after the priority of the element changed
+void
+heap_update(struct Heap *heap, size_t handle)
+{
+	size_t i = heap->pos[handle];
+	if (i > 0 && heap_compare(heap, &heap->entries[i], &heap->entries[(i - 1) / HEAP_ARITY]) < 0) {
+		heap_sift_up(heap, i);
+	} else {
+		heap_sift_down(heap, i);
+	}
+}
+
+void
+heap_truncate(struct Heap *heap)
+{
+	heap->len = 0;
+	heap->handles = 0;
+	heap->freelist = HEAP_NO_HANDLE;
+}
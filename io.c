@@ -91,28 +91,32 @@ char *
 slurp(FILE *f, struct Mempool *pool)
 {
 #define SLURP_BUF_SIZE	(8*1024*1024)
+	// fread() overwrites the buffer, so it is not zeroed.  Pages
+	// that are never read into are never touched.
 	size_t bufsize = SLURP_BUF_SIZE + 1;
-	char *buf = xrecallocarray(NULL, 0, bufsize, 1);
+	char *buf = xmalloc_uninit(bufsize);
 	size_t left = SLURP_BUF_SIZE;
-	ssize_t bytes;
 	size_t pos = 0;
-	while ((bytes = fread(buf + pos, left, 1, f)) != 0) {
-		if (bytes < 0) {
-			if (errno == EAGAIN) {
-				continue;
-			}
-			free(buf);
-			return NULL;
-		}
+	for (;;) {
+		size_t bytes = fread(buf + pos, 1, left, f);
 		left -= bytes;
 		pos += bytes;
 		if (left == 0) {
-			size_t oldsize = bufsize;
 			bufsize += SLURP_BUF_SIZE;
 			left = SLURP_BUF_SIZE;
-			buf = xrecallocarray(buf, oldsize, bufsize, 1);
+			buf = xreallocarray(buf, bufsize, 1);
+		} else if (ferror(f)) {
+			if (errno == EAGAIN) {
+				clearerr(f);
+				continue;
+			}
+			free(buf);
+			return NULL;
+		} else {
+			break;
 		}
 	}
+	buf[pos] = 0;
 
 	return mempool_take(pool, buf);
 }
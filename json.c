@@ -97,7 +97,7 @@ json_capture_machine(struct PEGCapture *capture, void *userdata)
 		array_append(array, value);
 		break;
 	} case PEG_JSON_OBJECT_BEGIN:
-		stack_push(data->objects, mempool_map(data->pool, str_compare, NULL, NULL, NULL));
+		stack_push(data->objects, mempool_map_hash(data->pool, str_hash, str_compare, NULL, NULL, NULL));
 		break;
 	case PEG_JSON_OBJECT_END: {
 		struct Map *object = stack_pop(data->objects);
@@ -186,7 +186,7 @@ objget_capture_machine(struct PEGCapture *capture, void *userdata)
 		break;
 	} case PEG_OBJGET_KEY: {
 		if (json_type(data->json) == JSON_OBJECT) {
-			char *key = xmalloc(capture->len + 1);
+			char *key = xmalloc_uninit(capture->len + 1);
 			char *ptr = key;
 			int escape = 0;
 			for (size_t i = 0; i < capture->len; i++) {
@@ -204,6 +204,7 @@ objget_capture_machine(struct PEGCapture *capture, void *userdata)
 					*ptr++ = c;
 				}
 			}
+			*ptr = 0;
 			data->json = map_get(json_unwrap_object(data->json), key);
 			free(key);
 		} else {
@@ -224,10 +225,13 @@ json_new(const char *buf, size_t len)
 {
 	struct JSONCaptureMachineData data;
 	memset(&data, 0, sizeof(data));
-	data.pool = mempool_new();
-	data.arrays = mempool_stack(data.pool);
-	data.objects = mempool_stack(data.pool);
-	data.values = mempool_stack(data.pool);
+	data.pool = mempool_new_arena();
+	SCOPE_STACK(arrays);
+	SCOPE_STACK(objects);
+	SCOPE_STACK(values);
+	data.arrays = &arrays;
+	data.objects = &objects;
+	data.values = &values;
 	data.buf = str_ndup(data.pool, buf, len);
 
 	struct PEG *peg = peg_new(data.buf, len);
@@ -248,6 +252,12 @@ json_free(struct JSON *json)
 	mempool_free(json->pool);
 }
 
+void
+json_free_async(struct JSON *json)
+{
+	mempool_free_async(json->pool);
+}
+
 struct JSON *
 json_get(struct JSON *json, const char *key)
 {
@@ -41,6 +41,7 @@ enum JSONType {
 
 struct JSON *json_new(const char *, size_t);
 void json_free(struct JSON *);
+void json_free_async(struct JSON *);
 
 struct JSON *json_get(struct JSON *, const char *);
 enum JSONType json_type(struct JSON *);
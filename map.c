@@ -28,61 +28,209 @@
 
 #include "config.h"
 
+#include <sys/param.h>
 #if HAVE_SYS_TREE
 # include <sys/tree.h>
 #endif
+#include COMPAT_ENDIAN_H
+#if HAVE_ERR
+# include <err.h>
+#endif
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "allocator.h"
 #include "array.h"
+#include "btree.h"
 #include "map.h"
 #include "mempool.h"
-#include "stack.h"
+#include "objpool.h"
 #include "util.h"
 
-struct MapNode {
-	RB_ENTRY(MapNode) entry;
+enum MapType {
+	MAP_TREE,
+	MAP_HASH,
+	MAP_BTREE,
+};
+
+struct MapSlot {
 	void *key;
 	void *value;
+};
+
+struct MapNode {
+	RB_ENTRY(MapNode) entry;
+	struct MapSlot slot;
 	struct Map *map;
 };
 
+struct MapRef {
+	void **key;
+	void **value;
+};
+
 struct Map {
+	enum MapType type;
 	RB_HEAD(MapTree, MapNode) root;
+	struct Objpool *nodes;
+	struct {
+		uint8_t *ctrl;
+		struct MapSlot *slots;
+		size_t cap;
+		size_t growth_left;
+	} table;
+	struct BTree btree;
 	MapCompareFn compare;
+	MapHashFn hash;
 	void *compare_userdata;
 	void (*keyfree)(void *);
 	void (*valuefree)(void *);
 	size_t len;
+	const struct Allocator *allocator;
 };
 
-struct MapIterator {
-	struct MapNode *current;
-	size_t index;
-};
+// Control bytes of the hash table.  Full slots store the lower 7
+// bits of the key's hash, so that most non-matching slots can be
+// skipped without calling the compare function.  Control bytes are
+// scanned MAP_GROUP_SIZE at a time.  The first MAP_GROUP_SIZE bytes
+// are mirrored after the end of the table so that a group can be
+// loaded at any position without wrapping around.
+#define MAP_CTRL_EMPTY ((uint8_t)0x80)
+#define MAP_CTRL_DELETED ((uint8_t)0xFE)
+#define MAP_GROUP_SIZE 8
+static const uint64_t MAP_GROUP_LSBS = 0x0101010101010101ULL;
+static const uint64_t MAP_GROUP_MSBS = 0x8080808080808080ULL;
 
+static struct MapNode *map_node_alloc(struct Map *);
 static void map_node_free(struct MapNode *);
+static void map_node_release(struct Map *, struct MapNode *);
 static int nodecmp(struct MapNode *, struct MapNode *);
 RB_PROTOTYPE(MapTree, MapNode, entry, nodecmp);
 
+static ssize_t map_table_find(struct Map *, const void *, uint64_t);
+static void map_table_free(struct Map *);
+static struct MapSlot *map_table_insert(struct Map *, const void *, int *);
+static void map_table_remove(struct Map *, const void *);
+static void map_table_truncate(struct Map *);
+
+static struct MapRef map_btree_find(struct Map *, const void *);
+static struct MapRef map_btree_insert(struct Map *, const void *, int *);
+static void map_btree_remove(struct Map *, const void *);
+
+static inline uint64_t
+map_hash(struct Map *map, const void *key)
+{
+	uint64_t h;
+	if (map->hash) {
+		h = map->hash(&key, map->compare_userdata);
+	} else {
+		h = (uintptr_t)key;
+	}
+	// Mix the bits so that weak hash functions and aligned
+	// pointers still spread over the whole table.
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static inline int
+map_keycmp(struct Map *map, const void *a, const void *b)
+{
+	if (map->compare) {
+		return map->compare(&a, &b, map->compare_userdata);
+	} else if (a == b) {
+		return 0;
+	} else if (a < b) {
+		return -1;
+	} else {
+		return 1;
+	}
+}
+
+static inline int
+map_keyeq(struct Map *map, const void *a, const void *b)
+{
+	if (map->compare) {
+		return map->compare(&a, &b, map->compare_userdata) == 0;
+	} else {
+		return a == b;
+	}
+}
+
+static inline uint64_t
+map_group_load(const uint8_t *ctrl)
+{
+	uint64_t group;
+	memcpy(&group, ctrl, sizeof(group));
+	return le64toh(group);
+}
+
+static inline uint64_t
+map_group_match(uint64_t group, uint8_t h2)
+{
+	uint64_t x = group ^ (MAP_GROUP_LSBS * h2);
+	return (x - MAP_GROUP_LSBS) & ~x & MAP_GROUP_MSBS;
+}
+
+static inline uint64_t
+map_group_match_empty(uint64_t group)
+{
+	return group & ~(group << 6) & MAP_GROUP_MSBS;
+}
+
+static inline uint64_t
+map_group_match_empty_or_deleted(uint64_t group)
+{
+	return group & ~(group << 7) & MAP_GROUP_MSBS;
+}
+
+static inline size_t
+map_group_first(uint64_t mask)
+{
+	return __builtin_ctzll(mask) / 8;
+}
+
+struct MapNode *
+map_node_alloc(struct Map *map)
+{
+	if (map->nodes == NULL) {
+		const struct Allocator *prev = allocator_use(map->allocator);
+		map->nodes = objpool_new(sizeof(struct MapNode));
+		allocator_use(prev);
+	}
+	return objpool_alloc(map->nodes);
+}
+
+// Frees the key and value of the node but not the node itself
 void
 map_node_free(struct MapNode *node)
 {
-	if (node == NULL) {
-		return;
-	}
 	if (node->map->keyfree) {
-		node->map->keyfree(node->key);
+		node->map->keyfree(node->slot.key);
 	}
 	if (node->map->valuefree) {
-		node->map->valuefree(node->value);
+		node->map->valuefree(node->slot.value);
 	}
-	free(node);
+}
+
+// Puts the node back on the free list for reuse by map_node_alloc()
+void
+map_node_release(struct Map *map, struct MapNode *node)
+{
+	objpool_release(map->nodes, node);
 }
 
 struct Map *
 map_new(MapCompareFn compare, void *compare_userdata, void *keyfree, void *valuefree)
 {
-	struct Map *map = xmalloc(sizeof(struct Map));
+	const struct Allocator *allocator = allocator_current();
+	struct Map *map = allocator_alloc(allocator, sizeof(struct Map));
+	map->allocator = allocator;
+	map->type = MAP_TREE;
 	RB_INIT(&map->root);
 	map->compare = compare;
 	map->compare_userdata = compare_userdata;
@@ -91,6 +239,57 @@ map_new(MapCompareFn compare, void *compare_userdata, void *keyfree, void *value
 	return map;
 }
 
+struct Map *
+map_new_hash(MapHashFn hash, MapCompareFn compare, void *compare_userdata, void *keyfree, void *valuefree)
+{
+	if (hash == NULL && compare) {
+		warnx("map_new_hash: a NULL hash function requires a NULL compare function");
+		abort();
+	}
+
+	const struct Allocator *allocator = allocator_current();
+	struct Map *map = allocator_alloc(allocator, sizeof(struct Map));
+	map->allocator = allocator;
+	map->type = MAP_HASH;
+	map->hash = hash;
+	map->compare = compare;
+	map->compare_userdata = compare_userdata;
+	map->keyfree = keyfree;
+	map->valuefree = valuefree;
+	return map;
+}
+
+struct Map *
+map_new_btree(MapCompareFn compare, void *compare_userdata, void *keyfree, void *valuefree)
+{
+	const struct Allocator *allocator = allocator_current();
+	struct Map *map = allocator_alloc(allocator, sizeof(struct Map));
+	map->allocator = allocator;
+	map->type = MAP_BTREE;
+	btree_init(&map->btree, compare, compare_userdata, allocator, 1);
+	map->compare = compare;
+	map->compare_userdata = compare_userdata;
+	map->keyfree = keyfree;
+	map->valuefree = valuefree;
+	return map;
+}
+
+struct Map *
+map_from_sorted_array(struct Array *keys, struct Array *values, MapCompareFn compare, void *compare_userdata, void *keyfree, void *valuefree)
+{
+	if (values && array_len(values) != array_len(keys)) {
+		warnx("map_from_sorted_array: %zu keys but %zu values", array_len(keys), array_len(values));
+		abort();
+	}
+	struct Map *map = map_new_btree(compare, compare_userdata, keyfree, valuefree);
+	if (!btree_build(&map->btree, keys, values, map->keyfree, map->valuefree)) {
+		warnx("map_from_sorted_array: keys are not sorted");
+		abort();
+	}
+	map->len = map->btree.len;
+	return map;
+}
+
 void
 map_free(struct Map *map)
 {
@@ -99,50 +298,236 @@ map_free(struct Map *map)
 	}
 
 	map_truncate(map);
-	free(map);
+	map_table_free(map);
+	objpool_free(map->nodes);
+	allocator_free(map->allocator, map);
+}
+
+static struct MapRef
+map_insert(struct Map *map, const void *key, int *inserted)
+{
+	switch (map->type) {
+	case MAP_TREE: {
+		// RB_INSERT returns the existing node on collision.  The
+		// unused node goes back on the free list.
+		struct MapNode *node = map_node_alloc(map);
+		node->slot.key = (void *)key;
+		node->slot.value = NULL;
+		node->map = map;
+		struct MapNode *existing = RB_INSERT(MapTree, &map->root, node);
+		if (existing) {
+			map_node_release(map, node);
+			*inserted = 0;
+			node = existing;
+		} else {
+			map->len++;
+			*inserted = 1;
+		}
+		return (struct MapRef){ &node->slot.key, &node->slot.value };
+	} case MAP_HASH: {
+		struct MapSlot *slot = map_table_insert(map, key, inserted);
+		return (struct MapRef){ &slot->key, &slot->value };
+	} case MAP_BTREE:
+		return map_btree_insert(map, key, inserted);
+	}
+
+	abort();
+}
+
+static struct MapRef
+map_find(struct Map *map, const void *key)
+{
+	switch (map->type) {
+	case MAP_TREE: {
+		struct MapNode search = { .slot.key = (void *)key, .map = map };
+		struct MapNode *node = RB_FIND(MapTree, &map->root, &search);
+		if (node) {
+			return (struct MapRef){ &node->slot.key, &node->slot.value };
+		}
+		break;
+	} case MAP_HASH: {
+		ssize_t i = map_table_find(map, key, map_hash(map, key));
+		if (i >= 0) {
+			return (struct MapRef){ &map->table.slots[i].key, &map->table.slots[i].value };
+		}
+		break;
+	} case MAP_BTREE:
+		return map_btree_find(map, key);
+	}
+
+	return (struct MapRef){ NULL, NULL };
 }
 
 void
 map_add(struct Map *map, const void *key, const void *value)
 {
-	if (!map_get(map, key)) {
-		struct MapNode *node = xmalloc(sizeof(struct MapNode));
-		node->key = (void *)key;
-		node->value = (void *)value;
-		node->map = map;
-		RB_INSERT(MapTree, &map->root, node);
-		map->len++;
+	int inserted;
+	struct MapRef ref = map_insert(map, key, &inserted);
+	if (inserted) {
+		*ref.value = (void *)value;
 	}
 }
 
+void **
+map_get_or_insert(struct Map *map, const void *key, int *inserted)
+{
+	int dummy;
+	if (inserted == NULL) {
+		inserted = &dummy;
+	}
+	return map_insert(map, key, inserted).value;
+}
+
+void
+map_put(struct Map *map, const void *key, const void *value)
+{
+	int inserted;
+	struct MapRef ref = map_insert(map, key, &inserted);
+	if (!inserted) {
+		void *oldkey = *ref.key;
+		*ref.key = (void *)key;
+		if (map->type == MAP_BTREE && oldkey != key) {
+			btree_replace_separator(&map->btree, oldkey, (void *)key);
+		}
+		if (map->keyfree && oldkey != key) {
+			map->keyfree(oldkey);
+		}
+		if (map->valuefree && *ref.value != value) {
+			map->valuefree(*ref.value);
+		}
+	}
+	*ref.value = (void *)value;
+}
+
 void
 map_remove(struct Map *map, const void *key)
 {
-	struct MapNode search = { .key = (void *)key, .map = map };
-	struct MapNode *node = RB_FIND(MapTree, &map->root, &search);
-	if (node) {
-		RB_REMOVE(MapTree, &map->root, node);
-		map_node_free(node);
-		map->len--;
+	switch (map->type) {
+	case MAP_TREE: {
+		struct MapNode search = { .slot.key = (void *)key, .map = map };
+		struct MapNode *node = RB_FIND(MapTree, &map->root, &search);
+		if (node) {
+			RB_REMOVE(MapTree, &map->root, node);
+			map_node_free(node);
+			map_node_release(map, node);
+			map->len--;
+		}
+		break;
+	} case MAP_HASH:
+		map_table_remove(map, key);
+		break;
+	case MAP_BTREE:
+		map_btree_remove(map, key);
+		break;
 	}
 }
 
 void *
 map_get(struct Map *map, const void *key)
 {
-	struct MapNode search = { .key = (void *)key, .map = map };
-	struct MapNode *node = RB_FIND(MapTree, &map->root, &search);
-	if (node) {
-		return node->value;
+	struct MapRef ref = map_find(map, key);
+	if (ref.key) {
+		return *ref.value;
 	} else {
 		return NULL;
 	}
 }
 
+int
+map_lookup(struct Map *map, const void *key, void **value)
+{
+	struct MapRef ref = map_find(map, key);
+	if (ref.key) {
+		if (value) {
+			*value = *ref.value;
+		}
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
 int
 map_contains(struct Map *map, const void *key)
 {
-	return map_get(map, key) != NULL;
+	return map_find(map, key).key != NULL;
+}
+
+static struct MapNode *
+map_tree_bound(struct Map *map, const void *key, int upper)
+{
+	struct MapNode search = { .slot.key = (void *)key, .map = map };
+	struct MapNode *node = RB_NFIND(MapTree, &map->root, &search);
+	if (upper && node && map_keycmp(map, node->slot.key, key) == 0) {
+		node = RB_NEXT(MapTree, &map->root, node);
+	}
+	return node;
+}
+
+static struct MapSlot *
+map_table_bound(struct Map *map, const void *key, int upper)
+{
+	// Hash tables have no order, so fall back to a full scan
+	struct MapSlot *bound = NULL;
+	for (size_t i = 0; i < map->table.cap; i++) {
+		if (map->table.ctrl[i] & MAP_CTRL_EMPTY) {
+			continue;
+		}
+		struct MapSlot *slot = &map->table.slots[i];
+		int cmp = map_keycmp(map, slot->key, key);
+		if ((upper ? cmp > 0 : cmp >= 0) &&
+		    (bound == NULL || map_keycmp(map, slot->key, bound->key) < 0)) {
+			bound = slot;
+		}
+	}
+	return bound;
+}
+
+static void *
+map_bound(struct Map *map, const void *key, void **value, int upper)
+{
+	struct MapSlot *slot = NULL;
+	switch (map->type) {
+	case MAP_TREE: {
+		struct MapNode *node = map_tree_bound(map, key, upper);
+		if (node) {
+			slot = &node->slot;
+		}
+		break;
+	} case MAP_HASH:
+		slot = map_table_bound(map, key, upper);
+		break;
+	case MAP_BTREE: {
+		size_t i;
+		struct BTreeNode *node = btree_bound(&map->btree, key, upper, &i);
+		if (node) {
+			if (value) {
+				*value = node->values[i];
+			}
+			return node->keys[i];
+		}
+		break;
+	} }
+
+	if (slot == NULL) {
+		return NULL;
+	}
+	if (value) {
+		*value = slot->value;
+	}
+	return slot->key;
+}
+
+void *
+map_lower_bound(struct Map *map, const void *key, void **value)
+{
+	return map_bound(map, key, value, 0);
+}
+
+void *
+map_upper_bound(struct Map *map, const void *key, void **value)
+{
+	return map_bound(map, key, value, 1);
 }
 
 size_t
@@ -154,19 +539,30 @@ map_len(struct Map *map)
 void
 map_truncate(struct Map *map)
 {
-	struct Stack *stack = stack_new();
-	struct MapNode *node;
-	struct MapNode *next;
-	for (node = RB_MIN(MapTree, &map->root); node != NULL; node = next) {
-		next = RB_NEXT(MapTree, &map->root, node);
-		stack_push(stack, node);
-	}
-	while ((node = stack_pop(stack))) {
-		map_node_free(node);
+	switch (map->type) {
+	case MAP_TREE: {
+		// Nodes are only released together with their object
+		// pool, so the tree can still be walked while freeing keys
+		// and values.
+		if (map->keyfree || map->valuefree) {
+			struct MapNode *node;
+			RB_FOREACH(node, MapTree, &map->root) {
+				map_node_free(node);
+			}
+		}
+		if (map->nodes) {
+			objpool_truncate(map->nodes);
+		}
+		RB_INIT(&map->root);
+		break;
+	} case MAP_HASH:
+		map_table_truncate(map);
+		break;
+	case MAP_BTREE:
+		btree_truncate(&map->btree, map->keyfree, map->valuefree);
+		break;
 	}
-	stack_free(stack);
 
-	RB_INIT(&map->root);
 	map->len = 0;
 }
 
@@ -174,9 +570,9 @@ struct Array *
 map_keys(struct Map *map, struct Mempool *pool)
 {
 	struct Array *array = mempool_array(pool);
-	struct MapNode *node;
-	RB_FOREACH(node, MapTree, &map->root) {
-		array_append(array, node->key);
+	array_reserve(array, map->len);
+	MAP_FOREACH(map, void *, key, void *, value) {
+		array_append(array, key);
 	}
 	return array;
 }
@@ -185,9 +581,9 @@ struct Array *
 map_values(struct Map *map, struct Mempool *pool)
 {
 	struct Array *array = mempool_array(pool);
-	struct MapNode *node;
-	RB_FOREACH(node, MapTree, &map->root) {
-		array_append(array, node->value);
+	array_reserve(array, map->len);
+	MAP_FOREACH(map, void *, key, void *, value) {
+		array_append(array, value);
 	}
 	return array;
 }
@@ -195,48 +591,300 @@ map_values(struct Map *map, struct Mempool *pool)
 int
 nodecmp(struct MapNode *e1, struct MapNode *e2)
 {
-	if (e1->map->compare) {
-		return e1->map->compare(&e1->key, &e2->key, e1->map->compare_userdata);
-	} else if (e1->key == e2->key) {
-		return 0;
-	} else if (e1->key < e2->key) {
+	return map_keycmp(e1->map, e1->slot.key, e2->slot.key);
+}
+
+RB_GENERATE(MapTree, MapNode, entry, nodecmp);
+
+static inline void
+map_table_set_ctrl(struct Map *map, size_t i, uint8_t h2)
+{
+	map->table.ctrl[i] = h2;
+	if (i < MAP_GROUP_SIZE) {
+		map->table.ctrl[map->table.cap + i] = h2;
+	}
+}
+
+static size_t
+map_table_find_free(struct Map *map, uint64_t h)
+{
+	size_t mask = map->table.cap - 1;
+	size_t pos = (h >> 7) & mask;
+	for (size_t stride = MAP_GROUP_SIZE; ; stride += MAP_GROUP_SIZE) {
+		uint64_t avail = map_group_match_empty_or_deleted(map_group_load(map->table.ctrl + pos));
+		if (avail) {
+			return (pos + map_group_first(avail)) & mask;
+		}
+		pos = (pos + stride) & mask;
+	}
+}
+
+static void
+map_table_resize(struct Map *map, size_t new_cap)
+{
+	uint8_t *old_ctrl = map->table.ctrl;
+	struct MapSlot *old_slots = map->table.slots;
+	size_t old_cap = map->table.cap;
+
+	map->table.cap = new_cap;
+	map->table.ctrl = allocator_alloc_uninit(map->allocator, new_cap + MAP_GROUP_SIZE);
+	memset(map->table.ctrl, MAP_CTRL_EMPTY, new_cap + MAP_GROUP_SIZE);
+	map->table.slots = allocator_recallocarray(map->allocator, NULL, 0, new_cap, sizeof(struct MapSlot));
+	map->table.growth_left = new_cap - new_cap / 8 - map->len;
+
+	for (size_t i = 0; i < old_cap; i++) {
+		if (old_ctrl[i] & MAP_CTRL_EMPTY) {
+			continue;
+		}
+		uint64_t h = map_hash(map, old_slots[i].key);
+		size_t j = map_table_find_free(map, h);
+		map_table_set_ctrl(map, j, h & 0x7F);
+		map->table.slots[j] = old_slots[i];
+	}
+
+	allocator_free(map->allocator, old_ctrl);
+	allocator_free(map->allocator, old_slots);
+}
+
+ssize_t
+map_table_find(struct Map *map, const void *key, uint64_t h)
+{
+	if (map->len == 0) {
 		return -1;
-	} else {
-		return 1;
+	}
+
+	size_t mask = map->table.cap - 1;
+	size_t pos = (h >> 7) & mask;
+	for (size_t stride = MAP_GROUP_SIZE; ; stride += MAP_GROUP_SIZE) {
+		uint64_t group = map_group_load(map->table.ctrl + pos);
+		for (uint64_t match = map_group_match(group, h & 0x7F); match; match &= match - 1) {
+			size_t i = (pos + map_group_first(match)) & mask;
+			if (map_keyeq(map, map->table.slots[i].key, key)) {
+				return i;
+			}
+		}
+		if (map_group_match_empty(group)) {
+			return -1;
+		}
+		pos = (pos + stride) & mask;
 	}
 }
 
-RB_GENERATE(MapTree, MapNode, entry, nodecmp);
+struct MapSlot *
+map_table_insert(struct Map *map, const void *key, int *inserted)
+{
+	uint64_t h = map_hash(map, key);
+	ssize_t existing = map_table_find(map, key, h);
+	if (existing >= 0) {
+		*inserted = 0;
+		return &map->table.slots[existing];
+	}
 
-struct MapIterator *
-map_iterator(struct Map *map)
+	if (map->table.cap == 0) {
+		map_table_resize(map, MAP_GROUP_SIZE);
+	}
+	size_t i = map_table_find_free(map, h);
+	if (map->table.growth_left == 0 && map->table.ctrl[i] == MAP_CTRL_EMPTY) {
+		// Grow the table unless most of the used capacity is
+		// tombstones, in which case rehashing in place is enough.
+		if (map->len * 2 >= map->table.cap - map->table.cap / 8) {
+			map_table_resize(map, map->table.cap * 2);
+		} else {
+			map_table_resize(map, map->table.cap);
+		}
+		i = map_table_find_free(map, h);
+	}
+
+	if (map->table.ctrl[i] == MAP_CTRL_EMPTY) {
+		map->table.growth_left--;
+	}
+	map_table_set_ctrl(map, i, h & 0x7F);
+	map->table.slots[i].key = (void *)key;
+	map->table.slots[i].value = NULL;
+	map->len++;
+	*inserted = 1;
+	return &map->table.slots[i];
+}
+
+void
+map_table_free(struct Map *map)
 {
-	struct MapIterator *iter = xmalloc(sizeof(struct MapIterator));
-	iter->current = RB_MIN(MapTree, &map->root);
-	return iter;
+	allocator_free(map->allocator, map->table.ctrl);
+	allocator_free(map->allocator, map->table.slots);
+	map->table.ctrl = NULL;
+	map->table.slots = NULL;
+	map->table.cap = 0;
+	map->table.growth_left = 0;
 }
 
 void
-map_iterator_free(struct MapIterator **iter)
+map_table_remove(struct Map *map, const void *key)
 {
-	if (*iter != NULL) {
-		free(*iter);
-		*iter = NULL;
+	ssize_t i = map_table_find(map, key, map_hash(map, key));
+	if (i < 0) {
+		return;
+	}
+
+	struct MapSlot slot = map->table.slots[i];
+	map_table_set_ctrl(map, i, MAP_CTRL_DELETED);
+	map->len--;
+
+	if (map->keyfree) {
+		map->keyfree(slot.key);
+	}
+	if (map->valuefree) {
+		map->valuefree(slot.value);
 	}
 }
 
-void *
-map_iterator_next(struct MapIterator **iter_, void **value, size_t *index)
+void
+map_table_truncate(struct Map *map)
 {
-	struct MapIterator *iter = *iter_;
-	if (iter->current == NULL) {
-		map_iterator_free(iter_);
-		return NULL;
+	if (map->keyfree || map->valuefree) {
+		for (size_t i = 0; i < map->table.cap; i++) {
+			if (map->table.ctrl[i] & MAP_CTRL_EMPTY) {
+				continue;
+			}
+			if (map->keyfree) {
+				map->keyfree(map->table.slots[i].key);
+			}
+			if (map->valuefree) {
+				map->valuefree(map->table.slots[i].value);
+			}
+		}
+	}
+	if (map->table.cap > 0) {
+		memset(map->table.ctrl, MAP_CTRL_EMPTY, map->table.cap + MAP_GROUP_SIZE);
+		map->table.growth_left = map->table.cap - map->table.cap / 8;
+	}
+}
+
+struct MapRef
+map_btree_find(struct Map *map, const void *key)
+{
+	size_t i;
+	struct BTreeNode *node = btree_find(&map->btree, key, &i);
+	if (node) {
+		return (struct MapRef){ &node->keys[i], &node->values[i] };
 	}
+	return (struct MapRef){ NULL, NULL };
+}
+
+struct MapRef
+map_btree_insert(struct Map *map, const void *key, int *inserted)
+{
+	size_t i;
+	struct BTreeNode *node = btree_insert(&map->btree, key, &i, inserted);
+	if (*inserted) {
+		map->len++;
+	}
+	return (struct MapRef){ &node->keys[i], &node->values[i] };
+}
+
+void
+map_btree_remove(struct Map *map, const void *key)
+{
+	void *oldkey;
+	void *oldvalue;
+	if (!btree_remove(&map->btree, key, &oldkey, &oldvalue)) {
+		return;
+	}
+	map->len--;
+	if (map->keyfree) {
+		map->keyfree(oldkey);
+	}
+	if (map->valuefree) {
+		map->valuefree(oldvalue);
+	}
+}
+
+struct MapIterator
+map_iterator(struct Map *map)
+{
+	return map_iterator_range(map, NULL, NULL);
+}
+
+struct MapIterator
+map_iterator_range(struct Map *map, const void *from, const void *to)
+{
+	struct MapIterator iter = { .map = map, .from = from, .to = to };
+	if (from && to && map_keycmp(map, from, to) >= 0) {
+		// Empty range
+		iter.slot = map->table.cap;
+		return iter;
+	}
+	switch (map->type) {
+	case MAP_TREE:
+		if (from) {
+			iter.current = map_tree_bound(map, from, 0);
+		} else {
+			iter.current = RB_MIN(MapTree, &map->root);
+		}
+		if (to) {
+			iter.end = map_tree_bound(map, to, 0);
+		}
+		break;
+	case MAP_HASH:
+		break;
+	case MAP_BTREE:
+		if (from) {
+			iter.current = btree_bound(&map->btree, from, 0, &iter.slot);
+		} else {
+			iter.current = btree_first(&map->btree);
+		}
+		if (to) {
+			iter.end = btree_bound(&map->btree, to, 0, &iter.end_slot);
+		}
+		break;
+	}
+	return iter;
+}
+
+void *
+map_iterator_next(struct MapIterator *iter, void **value, size_t *index)
+{
+	struct Map *map = iter->map;
+	switch (map->type) {
+	case MAP_TREE: {
+		if (iter->current == NULL || iter->current == iter->end) {
+			break;
+		}
+		struct MapNode *node = iter->current;
+		*index = iter->index++;
+		*value = node->slot.value;
+		iter->current = RB_NEXT(MapTree, &map->root, node);
+		return node->slot.key;
+	} case MAP_HASH:
+		for (; iter->slot < map->table.cap; iter->slot++) {
+			if (map->table.ctrl[iter->slot] & MAP_CTRL_EMPTY) {
+				continue;
+			}
+			struct MapSlot *slot = &map->table.slots[iter->slot];
+			if ((iter->from && map_keycmp(map, slot->key, iter->from) < 0) ||
+			    (iter->to && map_keycmp(map, slot->key, iter->to) >= 0)) {
+				continue;
+			}
+			*index = iter->index++;
+			*value = slot->value;
+			iter->slot++;
+			return slot->key;
+		}
+		break;
+	case MAP_BTREE: {
+		struct BTreeNode *node = iter->current;
+		if (node == NULL || (node == iter->end && iter->slot == iter->end_slot)) {
+			break;
+		}
+		*index = iter->index++;
+		*value = node->values[iter->slot];
+		void *key = node->keys[iter->slot++];
+		if (iter->slot == node->len) {
+			iter->current = node->next;
+			iter->slot = 0;
+		}
+		return key;
+	} }
 
-	*index = iter->index++;
-	void *key = iter->current->key;
-	*value = iter->current->value;
-	iter->current = RB_NEXT(MapTree, &(iter->current->map->root), iter->current);
-	return key;
+	iter->map = NULL;
+	return NULL;
 }
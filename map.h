@@ -31,24 +31,56 @@ struct Array;
 struct Mempool;
 struct Map;
 typedef int (*MapCompareFn)(const void *, const void *, void *);
+typedef uint64_t (*MapHashFn)(const void *, void *);
 
 struct Map *map_new(MapCompareFn, void *, void *, void *);
+// Without a hash function keys are compared by pointer identity, so
+// compare must be NULL too.
+struct Map *map_new_hash(MapHashFn, MapCompareFn, void *, void *, void *);
+struct Map *map_new_btree(MapCompareFn, void *, void *, void *);
+// Builds a map like map_new_btree() from keys in ascending order and
+// the values at the same indices.  values may be NULL.  Keys equal to
+// the one before them are dropped and passed to keyfree and valuefree.
+// Aborts if the keys are out of order or values has another length.
+struct Map *map_from_sorted_array(struct Array *, struct Array *, MapCompareFn, void *, void *, void *);
 void map_free(struct Map *);
 void map_add(struct Map *, const void *, const void *);
+void map_put(struct Map *, const void *, const void *);
+void **map_get_or_insert(struct Map *, const void *, int *);
 void map_remove(struct Map *, const void *);
 void *map_get(struct Map *, const void *);
+int map_lookup(struct Map *, const void *, void **);
 int map_contains(struct Map *, const void *);
+// Hash maps have no order to search, so on them the bounds and ranged
+// iterators scan the whole table in O(n) and yield keys in table order.
+void *map_lower_bound(struct Map *, const void *, void **);
+void *map_upper_bound(struct Map *, const void *, void **);
 size_t map_len(struct Map *);
 void map_truncate(struct Map *);
 struct Array *map_keys(struct Map *, struct Mempool *);
 struct Array *map_values(struct Map *, struct Mempool *);
 
-struct MapIterator *map_iterator(struct Map *);
-void map_iterator_free(struct MapIterator **);
-void *map_iterator_next(struct MapIterator **, void **, size_t *);
+struct MapIterator {
+	struct Map *map;
+	void *current;
+	void *end;
+	size_t slot;
+	size_t end_slot;
+	size_t index;
+	const void *from;
+	const void *to;
+};
 
-#define MAP_FOREACH(MAP, KEYTYPE, KEYVAR, VALTYPE, VALVAR) \
-	for (struct MapIterator *__##KEYVAR##_iter __cleanup(map_iterator_free) = map_iterator(MAP); __##KEYVAR##_iter != NULL; map_iterator_free(&__##KEYVAR##_iter)) \
-	for (size_t KEYVAR##_index = 0; __##KEYVAR##_iter != NULL; map_iterator_free(&__##KEYVAR##_iter)) \
-	for (VALTYPE VALVAR = NULL; __##KEYVAR##_iter != NULL; map_iterator_free(&__##KEYVAR##_iter)) \
+struct MapIterator map_iterator(struct Map *);
+// Scans the whole table on hash maps, see map_lower_bound()
+struct MapIterator map_iterator_range(struct Map *, const void *, const void *);
+void *map_iterator_next(struct MapIterator *, void **, size_t *);
+
+#define MAP_FOREACH_RANGE(MAP, FROM, TO, KEYTYPE, KEYVAR, VALTYPE, VALVAR) \
+	for (struct MapIterator __##KEYVAR##_iter = map_iterator_range(MAP, FROM, TO); __##KEYVAR##_iter.map != NULL; __##KEYVAR##_iter.map = NULL) \
+	for (size_t KEYVAR##_index = 0; __##KEYVAR##_iter.map != NULL; __##KEYVAR##_iter.map = NULL) \
+	for (VALTYPE VALVAR = NULL; __##KEYVAR##_iter.map != NULL; __##KEYVAR##_iter.map = NULL) \
 	for (KEYTYPE KEYVAR = map_iterator_next(&__##KEYVAR##_iter, (void **)&VALVAR, &KEYVAR##_index); KEYVAR != NULL; KEYVAR = map_iterator_next(&__##KEYVAR##_iter, (void **)&VALVAR, &KEYVAR##_index))
+
+#define MAP_FOREACH(MAP, KEYTYPE, KEYVAR, VALTYPE, VALVAR) \
+	MAP_FOREACH_RANGE(MAP, NULL, NULL, KEYTYPE, KEYVAR, VALTYPE, VALVAR)
@@ -28,46 +28,217 @@
 
 #include "config.h"
 
+// The callsite wrappers must not rename our own definitions
+#undef MEMPOOL_CALLSITES
+
+#include <sys/param.h>
 #include <assert.h>
+#if HAVE_ERR
+# include <err.h>
+#endif
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include "allocator.h"
 #include "array.h"
+#include "heap.h"
 #include "map.h"
 #include "mempool.h"
+#include "mempool/file.h"
+#include "mpmc.h"
+#include "objpool.h"
 #include "queue.h"
 #include "set.h"
 #include "stack.h"
+#include "str.h"
 #include "util.h"
 
-struct Mempool {
-	struct Stack *stack;
-	struct Map *map;
-	struct Mempool *owner;
+#define MEMPOOL_ALIGN 16
+#define MEMPOOL_CHUNK_MIN 4096
+#define MEMPOOL_CHUNK_MAX (1024 * 1024)
+#define MEMPOOL_RECLAIM_QUEUE 1024
+
+struct MempoolChunk {
+	struct MempoolChunk *next;
+	size_t size;
+	size_t used;
+	char data[] __attribute__((aligned(MEMPOOL_ALIGN)));
+};
+
+struct MempoolSite {
+	const char *callsite;
+	size_t allocations;
+	size_t bytes;
+	size_t live;
 };
 
 struct MempoolNode {
+	struct MempoolNode *prev;
+	struct MempoolNode *next;
+	// Other indexed nodes with the same ptr, oldest first
+	struct MempoolNode *dup;
+	struct Mempool *pool;
+	size_t seq;
 	void *ptr;
 	void (*freefn)(void *);
+	// Objects from mempool_alloc() have no freefn and go back to
+	// the allocator of the pool they were allocated from.
+	const struct Allocator *allocator;
+	size_t size;
+	struct MempoolSite *site;
 };
 
-static void *mempool_move_helper(struct Mempool *, void *, struct Mempool *);
+struct Mempool {
+	struct MempoolNode *head;
+	struct MempoolNode *tail;
+	// The index maps pointers to their nodes.  It is only built
+	// on the first lookup and then caught up lazily, so pools that
+	// never forget, move, or release single objects never pay for
+	// it.  All nodes up to and including indexed are in it.
+	struct Map *index;
+	struct MempoolNode *indexed;
+	// Nodes come from the pool they are first linked into and go
+	// back to node->pool->nodes.  This is always protected by the
+	// lock of the root pool.
+	struct Objpool *nodes;
+	// Inherited pools keep their nodes and chunks.  They are
+	// registered as a single node in their owner and all new
+	// objects go to the outermost owner.
+	struct Mempool *owner;
+	size_t seq;
+	int unique;
+	int arena;
+	// Concurrent pools serialize all operations with a recursive
+	// mutex so that free functions can call back into the pool.
+	// Pools that inherit a concurrent or thread-local pool become
+	// concurrent themselves.
+	int concurrent;
+	pthread_mutex_t mtx;
+	// Thread-local pools hand every thread its own arena on first
+	// use.  New arenas are pushed onto locals with a CAS so threads
+	// never wait on each other.
+	int local;
+	uint64_t id;
+	struct Mempool *locals;
+	struct Mempool *next_local;
+	pthread_t thread;
+	// Chunks are kept newest first.  current is the chunk that
+	// small allocations are bumped from.
+	struct MempoolChunk *chunks;
+	struct MempoolChunk *current;
+	// Counters cover inherited pools too.  Changes are propagated
+	// up the owner chain.  sites is only set when profiling.
+	struct MempoolStats stats;
+	int profile;
+	struct Map *sites;
+	// Chunks, nodes, the index, and objects from mempool_alloc()
+	// come from the allocator that was current on creation.
+	// Containers made with mempool_array() etc. use it too.
+	const struct Allocator *allocator;
+};
+
+static void mempool_account(struct Mempool *, ptrdiff_t, ptrdiff_t, ptrdiff_t, ptrdiff_t);
+static void mempool_append(struct Mempool *, struct MempoolNode *);
+static void mempool_collect_sites(struct Mempool *, struct Map *, struct Mempool *);
+static void *mempool_arena_alloc(struct Mempool *, size_t);
+static void mempool_destroy(struct Mempool *);
+static void mempool_free_chunks(struct Mempool *);
+static void mempool_free_inherited(void *);
+static void mempool_free_object(struct MempoolNode *);
+static void mempool_free_sites(struct Mempool *);
+static int mempool_in_chunks(struct Mempool *, void *);
+static void mempool_index_node(struct Mempool *, struct MempoolNode *);
+static void mempool_init_mutex(struct Mempool *);
+static struct Mempool *mempool_local(struct Mempool *);
+static struct Mempool *mempool_lock(struct Mempool *);
+static struct MempoolNode *mempool_lookup(struct Mempool *, void *);
+static int mempool_move_helper(struct Mempool *, void *, struct MempoolNode *);
+static struct Mempool *mempool_owner(struct Mempool *);
+static struct Mempool *mempool_target(struct Mempool *);
+static void *mempool_register(struct Mempool *, void *, void *, const struct Allocator *, size_t, const char *);
+static void mempool_release_nodes(struct Mempool *, struct Mempool *, size_t);
+static struct MempoolSite *mempool_site(struct Mempool *, const char *);
+static int mempool_site_compare(const void *, const void *, void *);
+static void mempool_unindex(struct Mempool *, struct Mempool *);
+static void mempool_unindex_node(struct Mempool *, struct MempoolNode *);
+static void mempool_unlink(struct Mempool *, struct MempoolNode *);
+static void mempool_unlock(struct Mempool *);
+static void mempool_update_index(struct Mempool *);
+static const struct Allocator *mempool_use_allocator(struct Mempool *);
+static void *mempool_reclaimer(void *);
+static void mempool_reclaimer_start(void);
+
+static uint64_t mempool_ids;
+static __thread struct Mempool *mempool_tls_pool;
+static __thread uint64_t mempool_tls_id;
+static __thread struct Mempool *mempool_tls_local;
+
+// Pools passed to mempool_free_async() are freed by a single
+// background thread.  pending counts pools that were queued but
+// not freed yet so that mempool_drain() can wait for them.
+static pthread_once_t mempool_reclaimer_once = PTHREAD_ONCE_INIT;
+static struct MPMC *mempool_reclaimer_queue;
+static pthread_mutex_t mempool_reclaimer_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mempool_reclaimer_idle = PTHREAD_COND_INITIALIZER;
+static size_t mempool_reclaimer_pending;
 
 struct Mempool *
 mempool_new()
 {
-	struct Mempool *pool = xmalloc(sizeof(struct Mempool));
-	pool->stack = stack_new();
+	const struct Allocator *allocator = allocator_current();
+	struct Mempool *pool = allocator_alloc(allocator, sizeof(struct Mempool));
+	pool->allocator = allocator;
 	pool->owner = pool;
+	pool->nodes = objpool_new(sizeof(struct MempoolNode));
+	return pool;
+}
+
+struct Mempool *
+mempool_new_arena(void)
+{
+	struct Mempool *pool = mempool_new();
+	pool->arena = 1;
+	return pool;
+}
+
+struct Mempool *
+mempool_new_concurrent(void)
+{
+	struct Mempool *pool = mempool_new();
+	mempool_init_mutex(pool);
+	return pool;
+}
+
+void
+mempool_init_mutex(struct Mempool *pool)
+{
+	pool->concurrent = 1;
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&pool->mtx, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+struct Mempool *
+mempool_new_local(void)
+{
+	struct Mempool *pool = mempool_new();
+	pool->local = 1;
+	pool->id = __atomic_add_fetch(&mempool_ids, 1, __ATOMIC_RELAXED);
 	return pool;
 }
 
 struct Mempool *
 mempool_new_unique()
 {
-	struct Mempool *pool = xmalloc(sizeof(struct Mempool));
-	pool->map = map_new(NULL, NULL, NULL, NULL);
-	pool->owner = pool;
+	struct Mempool *pool = mempool_new();
+	pool->unique = 1;
 	return pool;
 }
 
@@ -77,14 +248,116 @@ mempool_free(struct Mempool *pool)
 	if (pool == NULL) {
 		return;
 	}
-	if (pool->owner == pool) {
+	// Inherited pools are freed together with their owner
+	if (pool->owner != pool) {
+		return;
+	}
+
+	if (!pool->local) {
 		mempool_release_all(pool);
+	}
+	mempool_destroy(pool);
+}
+
+void
+mempool_free_inherited(void *ptr)
+{
+	struct Mempool *pool = ptr;
+	mempool_release_nodes(pool, mempool_owner(pool), 0);
+	mempool_free_chunks(pool);
+	mempool_account(pool->owner, 0, 0, 0, -1);
+	mempool_destroy(pool);
+}
+
+// Frees what is left of a pool after its objects were released
+void
+mempool_destroy(struct Mempool *pool)
+{
+	if (pool->local) {
+		struct Mempool *local = __atomic_load_n(&pool->locals, __ATOMIC_ACQUIRE);
+		while (local) {
+			struct Mempool *next = local->next_local;
+			mempool_free(local);
+			local = next;
+		}
+		if (mempool_tls_pool == pool) {
+			mempool_tls_pool = NULL;
+		}
+	}
+	if (pool->concurrent) {
+		pthread_mutex_destroy(&pool->mtx);
+	}
+	map_free(pool->index);
+	mempool_free_sites(pool);
+	objpool_free(pool->nodes);
+	allocator_free(pool->allocator, pool);
+}
+
+void
+mempool_free_async(struct Mempool *pool)
+{
+	// Same as mempool_free() for NULL and inherited pools.  The
+	// latter are freed together with their owner.
+	if (pool == NULL || pool->owner != pool) {
+		mempool_free(pool);
+		return;
+	}
+
+	pthread_once(&mempool_reclaimer_once, mempool_reclaimer_start);
+	if (mempool_reclaimer_queue == NULL) {
+		// No reclaimer thread
+		mempool_free(pool);
+		return;
+	}
+
+	pthread_mutex_lock(&mempool_reclaimer_mtx);
+	mempool_reclaimer_pending++;
+	pthread_mutex_unlock(&mempool_reclaimer_mtx);
+	// Only blocks when the reclaimer is more than a full queue
+	// behind
+	mpmc_push_wait(mempool_reclaimer_queue, pool);
+}
+
+void
+mempool_drain(void)
+{
+	pthread_mutex_lock(&mempool_reclaimer_mtx);
+	while (mempool_reclaimer_pending > 0) {
+		pthread_cond_wait(&mempool_reclaimer_idle, &mempool_reclaimer_mtx);
+	}
+	pthread_mutex_unlock(&mempool_reclaimer_mtx);
+}
+
+void
+mempool_reclaimer_start(void)
+{
+	struct MPMC *queue = mpmc_new(MEMPOOL_RECLAIM_QUEUE);
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_t thread;
+	if (pthread_create(&thread, &attr, mempool_reclaimer, queue) == 0) {
+		mempool_reclaimer_queue = queue;
 	} else {
-		mempool_forget(pool->owner, pool);
+		mpmc_free(queue);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+void *
+mempool_reclaimer(void *userdata)
+{
+	struct MPMC *queue = userdata;
+	struct Mempool *pool;
+	while ((pool = mpmc_pop_wait(queue))) {
+		mempool_free(pool);
+		pthread_mutex_lock(&mempool_reclaimer_mtx);
+		if (--mempool_reclaimer_pending == 0) {
+			pthread_cond_broadcast(&mempool_reclaimer_idle);
+		}
+		pthread_mutex_unlock(&mempool_reclaimer_mtx);
 	}
-	map_free(pool->map);
-	stack_free(pool->stack);
-	free(pool);
+	return NULL;
 }
 
 void
@@ -96,96 +369,455 @@ mempool_cleanup(struct Mempool **pool)
 	}
 }
 
+struct Mempool *
+mempool_owner(struct Mempool *pool)
+{
+	struct Mempool *owner;
+	while ((owner = __atomic_load_n(&pool->owner, __ATOMIC_ACQUIRE)) != pool) {
+		pool = owner;
+	}
+	return pool;
+}
+
+// Makes the allocator of pool current so that containers created
+// for it use it too.  Returns the previous override.
+const struct Allocator *
+mempool_use_allocator(struct Mempool *pool)
+{
+	if (pool) {
+		return allocator_use(mempool_owner(pool)->allocator);
+	} else {
+		return allocator_use(allocator_current());
+	}
+}
+
 void *
 mempool_add(struct Mempool *pool, void *ptr, void *freefn)
 {
-	if (!pool || !ptr || !freefn) {
+	return mempool_add_at(pool, NULL, ptr, freefn);
+}
+
+void *
+mempool_add_at(struct Mempool *pool, const char *callsite, void *ptr, void *freefn)
+{
+	return mempool_register(pool, ptr, freefn, NULL, 0, callsite);
+}
+
+void *
+mempool_register(struct Mempool *pool, void *ptr, void *freefn, const struct Allocator *allocator, size_t size, const char *callsite)
+{
+	if (!pool || !ptr || (!freefn && !allocator)) {
 		return ptr;
 	}
 
-	pool = pool->owner;
+	pool = mempool_lock(pool);
+	struct MempoolNode *node = objpool_alloc(pool->nodes);
+	node->ptr = ptr;
+	node->freefn = freefn;
+	node->allocator = allocator;
+	node->size = size;
+	if (pool->sites) {
+		node->site = mempool_site(pool, callsite);
+	}
+	mempool_append(pool, node);
+	mempool_unlock(pool);
+
+	return ptr;
+}
 
-	if (pool->map) {
-		map_add(pool->map, ptr, freefn);
+struct MempoolSite *
+mempool_site(struct Mempool *pool, const char *callsite)
+{
+	if (callsite == NULL) {
+		callsite = "(unknown)";
+	}
+	struct MempoolSite *site = map_get(pool->sites, callsite);
+	if (site == NULL) {
+		site = allocator_alloc(pool->allocator, sizeof(struct MempoolSite));
+		site->callsite = callsite;
+		map_add(pool->sites, site->callsite, site);
+	}
+	return site;
+}
+
+void
+mempool_free_sites(struct Mempool *pool)
+{
+	if (pool->sites) {
+		MAP_FOREACH(pool->sites, const char *, callsite, struct MempoolSite *, site) {
+			allocator_free(pool->allocator, site);
+		}
+		map_free(pool->sites);
+	}
+}
+
+void
+mempool_account(struct Mempool *pool, ptrdiff_t objects, ptrdiff_t bytes, ptrdiff_t chunk_bytes, ptrdiff_t inherited)
+{
+	for (;;) {
+		struct MempoolStats *stats = &pool->stats;
+		stats->objects += objects;
+		stats->bytes += bytes;
+		stats->chunk_bytes += chunk_bytes;
+		stats->inherited += inherited;
+		stats->peak_objects = MAX(stats->peak_objects, stats->objects);
+		stats->peak_bytes = MAX(stats->peak_bytes, stats->bytes);
+		if (pool->owner == pool) {
+			break;
+		}
+		pool = pool->owner;
+	}
+}
+
+struct Mempool *
+mempool_local(struct Mempool *pool)
+{
+	if (mempool_tls_pool == pool && mempool_tls_id == pool->id) {
+		return mempool_tls_local;
+	}
+
+	pthread_t self = pthread_self();
+	struct Mempool *local = __atomic_load_n(&pool->locals, __ATOMIC_ACQUIRE);
+	for (; local; local = local->next_local) {
+		if (pthread_equal(local->thread, self)) {
+			break;
+		}
+	}
+	if (local == NULL) {
+		const struct Allocator *prev = allocator_use(pool->allocator);
+		local = mempool_new_arena();
+		allocator_use(prev);
+		local->thread = self;
+		if (pool->profile) {
+			mempool_profile(local);
+		}
+		local->next_local = __atomic_load_n(&pool->locals, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&pool->locals, &local->next_local, local, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+
+	mempool_tls_pool = pool;
+	mempool_tls_id = pool->id;
+	mempool_tls_local = local;
+	return local;
+}
+
+// Returns the pool that operations on pool end up in
+struct Mempool *
+mempool_target(struct Mempool *pool)
+{
+	pool = mempool_owner(pool);
+	if (pool->local) {
+		pool = mempool_local(pool);
+	}
+	return pool;
+}
+
+struct Mempool *
+mempool_lock(struct Mempool *pool)
+{
+	for (;;) {
+		struct Mempool *owner = mempool_target(pool);
+		if (!owner->concurrent) {
+			return owner;
+		}
+		pthread_mutex_lock(&owner->mtx);
+		// pool might have been inherited or moved out of its
+		// owner while we were waiting
+		if (mempool_target(pool) == owner) {
+			return owner;
+		}
+		pthread_mutex_unlock(&owner->mtx);
+	}
+}
+
+void
+mempool_unlock(struct Mempool *pool)
+{
+	if (pool->concurrent) {
+		pthread_mutex_unlock(&pool->mtx);
+	}
+}
+
+void
+mempool_append(struct Mempool *pool, struct MempoolNode *node)
+{
+	if (pool->unique) {
+		mempool_update_index(pool);
+		if (map_contains(pool->index, node->ptr)) {
+			objpool_release(pool->nodes, node);
+			return;
+		}
+	}
+
+	node->pool = pool;
+	node->seq = pool->seq++;
+	node->prev = pool->tail;
+	node->next = NULL;
+	if (pool->tail) {
+		pool->tail->next = node;
 	} else {
-		struct MempoolNode *node = xmalloc(sizeof(struct MempoolNode));
-		node->ptr = ptr;
-		node->freefn = freefn;
-		stack_push(pool->stack, node);
+		pool->head = node;
 	}
+	pool->tail = node;
 
-	return ptr;
+	mempool_account(pool, 1, node->size, 0, 0);
+	if (node->site) {
+		node->site->allocations++;
+		node->site->bytes += node->size;
+		node->site->live++;
+	}
 }
 
-void *
-mempool_forget(struct Mempool *pool, void *ptr)
+void
+mempool_unlink(struct Mempool *pool, struct MempoolNode *node)
 {
-	if (pool) {
-		mempool_move_helper(pool->owner, ptr, NULL);
+	mempool_account(pool, -1, -(ptrdiff_t)node->size, 0, 0);
+	if (node->site) {
+		node->site->live--;
+	}
+
+	if (node == pool->indexed) {
+		pool->indexed = node->prev;
+	}
+	if (node->prev) {
+		node->prev->next = node->next;
+	} else {
+		pool->head = node->next;
+	}
+	if (node->next) {
+		node->next->prev = node->prev;
+	} else {
+		pool->tail = node->prev;
 	}
-	return ptr;
 }
 
 void
-mempool_inherit(struct Mempool *pool, struct Mempool *other)
+mempool_update_index(struct Mempool *pool)
 {
-	if (pool && other && pool != other && pool->owner != other && other->owner != pool) {
-		mempool_add(pool, other, mempool_free);
-		other->owner = pool;
-		if (other->map) {
-			MAP_FOREACH(other->map, void *, ptr, void *, freefn) {
-				mempool_add(pool, ptr, freefn);
-			}
-			map_truncate(other->map);
+	if (pool->index == NULL) {
+		const struct Allocator *prev = allocator_use(pool->allocator);
+		pool->index = map_new_hash(NULL, NULL, NULL, NULL, NULL);
+		allocator_use(prev);
+	}
+
+	struct MempoolNode *node = pool->head;
+	if (pool->indexed) {
+		node = pool->indexed->next;
+	}
+	while (node) {
+		struct MempoolNode *next = node->next;
+		mempool_index_node(pool, node);
+		if (next) {
+			pool->indexed = next->prev;
 		} else {
-			struct MempoolNode *node;
-			while ((node = stack_pop(other->stack))) {
-				if (pool->map) {
-					mempool_add(pool, node->ptr, node->freefn);
-					free(node);
-				} else {
-					stack_push(pool->stack, node);
-				}
-			}
+			pool->indexed = pool->tail;
 		}
+		node = next;
 	}
 }
 
-static void *
-mempool_move_helper(struct Mempool *pool, void *ptr, struct Mempool *other)
+void
+mempool_index_node(struct Mempool *pool, struct MempoolNode *node)
 {
-	if (!pool || pool == other) {
-		return NULL;
+	int inserted;
+	struct MempoolNode **slot = (struct MempoolNode **)map_get_or_insert(pool->index, node->ptr, &inserted);
+	node->dup = NULL;
+	if (inserted) {
+		*slot = node;
+	} else if (pool->unique) {
+		// Unique pools only keep the first registration.  This
+		// can only happen here for nodes of inherited pools.
+		mempool_unlink(node->pool, node);
+		objpool_release(node->pool->nodes, node);
+		return;
+	} else {
+		struct MempoolNode *last = *slot;
+		while (last->dup) {
+			last = last->dup;
+		}
+		last->dup = node;
 	}
 
-	void *freefn = NULL;
-	if (pool->map) {
-		freefn = map_get(pool->map, ptr);
-		if (freefn) {
-			map_remove(pool->map, ptr);
+	if (node->freefn == mempool_free_inherited) {
+		struct Mempool *other = node->ptr;
+		struct MempoolNode *child = other->head;
+		while (child) {
+			struct MempoolNode *next = child->next;
+			mempool_index_node(pool, child);
+			child = next;
 		}
-	} else {
-		STACK_FOREACH(pool->stack, struct MempoolNode *, node) {
-			if (node->ptr == ptr) {
-				freefn = node->freefn;
-				node->ptr = NULL;
+	}
+}
+
+void
+mempool_unindex(struct Mempool *pool, struct Mempool *other)
+{
+	for (struct MempoolNode *node = other->head; node; node = node->next) {
+		mempool_unindex_node(pool, node);
+		if (node->freefn == mempool_free_inherited) {
+			mempool_unindex(pool, node->ptr);
+		}
+	}
+}
+
+// Drops node from the index if it is in it
+void
+mempool_unindex_node(struct Mempool *pool, struct MempoolNode *node)
+{
+	if (pool->index == NULL) {
+		return;
+	}
+	struct MempoolNode *head = map_get(pool->index, node->ptr);
+	if (head == node) {
+		if (node->dup) {
+			map_put(pool->index, node->ptr, node->dup);
+		} else {
+			map_remove(pool->index, node->ptr);
+		}
+	} else if (head) {
+		for (; head->dup; head = head->dup) {
+			if (head->dup == node) {
+				head->dup = node->dup;
 				break;
 			}
 		}
 	}
+}
 
-	if (other) {
-		mempool_add(other, ptr, freefn);
+struct MempoolNode *
+mempool_lookup(struct Mempool *pool, void *ptr)
+{
+	mempool_update_index(pool);
+	struct MempoolNode *node = map_get(pool->index, ptr);
+	if (node) {
+		mempool_unindex_node(pool, node);
+		mempool_unlink(node->pool, node);
 	}
+	return node;
+}
 
-	return freefn;
+void
+mempool_release_nodes(struct Mempool *pool, struct Mempool *owner, size_t seq)
+{
+	struct MempoolNode *node;
+	while ((node = pool->tail) && node->seq >= seq) {
+		mempool_unindex_node(owner, node);
+		mempool_unlink(pool, node);
+		mempool_free_object(node);
+		objpool_release(pool->nodes, node);
+	}
+}
+
+void
+mempool_free_object(struct MempoolNode *node)
+{
+	if (node->freefn) {
+		node->freefn(node->ptr);
+	} else {
+		allocator_free(node->allocator, node->ptr);
+	}
 }
 
 void *
-mempool_move(struct Mempool *pool, void *ptr, struct Mempool *other)
+mempool_forget(struct Mempool *pool, void *ptr)
 {
 	if (pool) {
-		mempool_move_helper(pool->owner, ptr, other);
+		struct MempoolNode node;
+		mempool_move_helper(pool, ptr, &node);
+	}
+	return ptr;
+}
+
+void
+mempool_inherit(struct Mempool *pool, struct Mempool *other)
+{
+	if (pool == NULL || other == NULL) {
+		return;
+	}
+	pool = mempool_lock(pool);
+	if (other->concurrent) {
+		pthread_mutex_lock(&other->mtx);
+	}
+	if (other->owner == other && mempool_owner(pool) != other) {
+		struct MempoolNode *node = objpool_alloc(pool->nodes);
+		node->ptr = other;
+		node->freefn = mempool_free_inherited;
+		mempool_append(pool, node);
+		struct MempoolStats *stats = &other->stats;
+		mempool_account(pool, stats->objects, stats->bytes, stats->chunk_bytes, stats->inherited + 1);
+		// Calls through other end up in the owner from now on,
+		// so it has to be safe to use from several threads too
+		if ((other->concurrent || other->local) && !pool->concurrent) {
+			mempool_init_mutex(pool);
+			pthread_mutex_lock(&pool->mtx);
+		}
+		__atomic_store_n(&other->owner, pool, __ATOMIC_RELEASE);
+	}
+	if (other->concurrent) {
+		pthread_mutex_unlock(&other->mtx);
+	}
+	mempool_unlock(pool);
+}
+
+// Unlinks the node of ptr and leaves a copy of it in removed
+static int
+mempool_move_helper(struct Mempool *pool, void *ptr, struct MempoolNode *removed)
+{
+	pool = mempool_lock(pool);
+	struct MempoolNode *node = mempool_lookup(pool, ptr);
+	if (node) {
+		*removed = *node;
+		objpool_release(node->pool->nodes, node);
+		if (removed->freefn == mempool_free_inherited) {
+			struct Mempool *other = ptr;
+			struct MempoolStats *stats = &other->stats;
+			mempool_account(pool, -(ptrdiff_t)stats->objects, -(ptrdiff_t)stats->bytes, -(ptrdiff_t)stats->chunk_bytes, -(ptrdiff_t)stats->inherited - 1);
+			mempool_unindex(pool, other);
+			// Its own index went stale while it was inherited
+			map_free(other->index);
+			other->index = NULL;
+			other->indexed = NULL;
+			__atomic_store_n(&other->owner, other, __ATOMIC_RELEASE);
+			removed->freefn = (void (*)(void *))mempool_free;
+		}
+	} else if (mempool_in_chunks(pool, ptr)) {
+		warnx("mempool: %p was bumped from an arena and cannot be forgotten, moved, or released", ptr);
+		abort();
+	}
+	mempool_unlock(pool);
+
+	return node != NULL;
+}
+
+// Checks if ptr points into the chunks of pool or one of the pools
+// it inherited
+int
+mempool_in_chunks(struct Mempool *pool, void *ptr)
+{
+	if (pool->stats.chunk_bytes == 0) {
+		return 0;
+	}
+	for (struct MempoolChunk *chunk = pool->chunks; chunk; chunk = chunk->next) {
+		if ((uintptr_t)ptr >= (uintptr_t)chunk->data && (uintptr_t)ptr < (uintptr_t)chunk->data + chunk->size) {
+			return 1;
+		}
+	}
+	for (struct MempoolNode *node = pool->head; node; node = node->next) {
+		if (node->freefn == mempool_free_inherited && mempool_in_chunks(node->ptr, ptr)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void *
+mempool_move(struct Mempool *pool, void *ptr, struct Mempool *other)
+{
+	if (pool && (!other || mempool_owner(pool) != mempool_owner(other))) {
+		struct MempoolNode node;
+		if (mempool_move_helper(pool, ptr, &node)) {
+			mempool_register(other, ptr, node.freefn, node.allocator, node.size, NULL);
+		}
 	}
 	return ptr;
 }
@@ -194,9 +826,9 @@ void *
 mempool_release(struct Mempool *pool, void *ptr)
 {
 	if (pool) {
-		void (*freefn)(void *) = mempool_move_helper(pool->owner, ptr, NULL);
-		if (freefn) {
-			freefn(ptr);
+		struct MempoolNode node;
+		if (mempool_move_helper(pool, ptr, &node)) {
+			mempool_free_object(&node);
 		}
 	}
 	return ptr;
@@ -208,63 +840,447 @@ mempool_release_all(struct Mempool *pool)
 	if (!pool) {
 		return;
 	}
-	pool = pool->owner;
+	pool = mempool_lock(pool);
+
+	// Drop duplicates from inherited pools first
+	if (pool->unique) {
+		mempool_update_index(pool);
+	}
+	mempool_release_nodes(pool, pool, 0);
+	mempool_free_chunks(pool);
 
-	if (pool->map) {
-		MAP_FOREACH(pool->map, void *, ptr, void *, f) {
-			void (*freefn)(void *) = f;
-			freefn(ptr);
+	mempool_unlock(pool);
+}
+
+struct MempoolMark
+mempool_mark(struct Mempool *pool)
+{
+	struct MempoolMark mark = { 0 };
+	if (pool) {
+		pool = mempool_lock(pool);
+		mark.seq = pool->seq;
+		mark.chunks = pool->chunks;
+		mark.current = pool->current;
+		if (pool->current) {
+			mark.used = pool->current->used;
 		}
-		map_truncate(pool->map);
+		mempool_unlock(pool);
+	}
+	return mark;
+}
+
+void
+mempool_rollback(struct Mempool *pool, struct MempoolMark mark)
+{
+	if (!pool) {
+		return;
+	}
+	pool = mempool_lock(pool);
+
+	if (pool->unique) {
+		mempool_update_index(pool);
+	}
+	mempool_release_nodes(pool, pool, mark.seq);
+
+	while (pool->chunks && pool->chunks != mark.chunks) {
+		struct MempoolChunk *next = pool->chunks->next;
+		mempool_account(pool, 0, -(ptrdiff_t)pool->chunks->used, -(ptrdiff_t)pool->chunks->size, 0);
+		allocator_free(pool->allocator, pool->chunks);
+		pool->chunks = next;
+	}
+	if (pool->chunks && mark.current) {
+		// mempool_alloc() zeroes on its own, so the rest of the
+		// chunk can be handed out again as is
+		pool->current = mark.current;
+		mempool_account(pool, 0, -(ptrdiff_t)(pool->current->used - mark.used), 0, 0);
+		pool->current->used = mark.used;
 	} else {
-		struct MempoolNode *node;
-		while ((node = stack_pop(pool->stack))) {
-			if (node->ptr) {
-				node->freefn(node->ptr);
-				free(node);
-			}
-		}
+		pool->current = NULL;
 	}
+
+	mempool_unlock(pool);
 }
 
 void *
 mempool_alloc(struct Mempool *pool, size_t sz)
 {
-	return mempool_add(pool, xmalloc(sz), free);
+	return mempool_alloc_at(pool, NULL, sz);
+}
+
+void *
+mempool_alloc_at(struct Mempool *pool, const char *callsite, size_t sz)
+{
+	void *ptr = mempool_alloc_uninit_at(pool, callsite, sz);
+	memset(ptr, 0, sz);
+	return ptr;
+}
+
+void *
+mempool_alloc_uninit(struct Mempool *pool, size_t sz)
+{
+	return mempool_alloc_uninit_at(pool, NULL, sz);
+}
+
+void *
+mempool_alloc_uninit_at(struct Mempool *pool, const char *callsite, size_t sz)
+{
+	if (pool == NULL) {
+		return xmalloc_uninit(sz);
+	}
+
+	pool = mempool_lock(pool);
+	if (pool->arena) {
+		void *ptr = mempool_arena_alloc(pool, sz);
+		if (pool->sites) {
+			struct MempoolSite *site = mempool_site(pool, callsite);
+			site->allocations++;
+			site->bytes += sz;
+		}
+		mempool_unlock(pool);
+		return ptr;
+	}
+	const struct Allocator *allocator = pool->allocator;
+	mempool_unlock(pool);
+	return mempool_register(pool, allocator_alloc_uninit(allocator, sz), NULL, allocator, sz, callsite);
+}
+
+void *
+mempool_arena_alloc(struct Mempool *pool, size_t sz)
+{
+	struct MempoolChunk *chunk = pool->current;
+	if (chunk) {
+		uintptr_t start = (uintptr_t)chunk->data;
+		uintptr_t p = (start + chunk->used + MEMPOOL_ALIGN - 1) & ~(uintptr_t)(MEMPOOL_ALIGN - 1);
+		if (p - start <= chunk->size && sz <= chunk->size - (p - start)) {
+			mempool_account(pool, 0, p - start + sz - chunk->used, 0, 0);
+			chunk->used = p - start + sz;
+			return (void *)p;
+		}
+	}
+
+	size_t size = MEMPOOL_CHUNK_MIN;
+	if (chunk) {
+		size = MIN(chunk->size * 2, MEMPOOL_CHUNK_MAX);
+	}
+
+	if (sz > size / 4) {
+		// Large objects get a chunk of their own so that the
+		// remainder of the current chunk is not wasted.
+		struct MempoolChunk *large = allocator_alloc_uninit(pool->allocator, sizeof(struct MempoolChunk) + sz + MEMPOOL_ALIGN);
+		large->size = sz + MEMPOOL_ALIGN;
+		large->used = large->size;
+		large->next = pool->chunks;
+		pool->chunks = large;
+		mempool_account(pool, 0, large->used, large->size, 0);
+		uintptr_t p = ((uintptr_t)large->data + MEMPOOL_ALIGN - 1) & ~(uintptr_t)(MEMPOOL_ALIGN - 1);
+		return (void *)p;
+	}
+
+	struct MempoolChunk *next = allocator_alloc_uninit(pool->allocator, sizeof(struct MempoolChunk) + size);
+	next->size = size;
+	next->used = 0;
+	next->next = pool->chunks;
+	pool->chunks = next;
+	pool->current = next;
+	mempool_account(pool, 0, 0, size, 0);
+	return mempool_arena_alloc(pool, sz);
+}
+
+void
+mempool_free_chunks(struct Mempool *pool)
+{
+	struct MempoolChunk *chunk = pool->chunks;
+	while (chunk) {
+		struct MempoolChunk *next = chunk->next;
+		mempool_account(pool, 0, -(ptrdiff_t)chunk->used, -(ptrdiff_t)chunk->size, 0);
+		allocator_free(pool->allocator, chunk);
+		chunk = next;
+	}
+	pool->chunks = NULL;
+	pool->current = NULL;
+}
+
+void
+mempool_profile(struct Mempool *pool)
+{
+	pool = mempool_owner(pool);
+	if (pool->local) {
+		pool->profile = 1;
+		struct Mempool *local = __atomic_load_n(&pool->locals, __ATOMIC_ACQUIRE);
+		for (; local; local = local->next_local) {
+			mempool_profile(local);
+		}
+	} else {
+		pool = mempool_lock(pool);
+		pool->profile = 1;
+		if (pool->sites == NULL) {
+			const struct Allocator *prev = allocator_use(pool->allocator);
+			pool->sites = map_new_hash(str_hash, str_compare, NULL, NULL, NULL);
+			allocator_use(prev);
+		}
+		mempool_unlock(pool);
+	}
+}
+
+void
+mempool_stats(struct Mempool *pool, struct MempoolStats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	if (pool == NULL) {
+		return;
+	}
+
+	struct Mempool *owner = mempool_owner(pool);
+	if (owner->local) {
+		// Other threads might still be running so this is only
+		// a snapshot.
+		struct Mempool *local = __atomic_load_n(&owner->locals, __ATOMIC_ACQUIRE);
+		for (; local; local = local->next_local) {
+			stats->objects += local->stats.objects;
+			stats->bytes += local->stats.bytes;
+			// Threads peak at different times, so the sum
+			// would overstate it
+			stats->peak_objects = MAX(stats->peak_objects, local->stats.peak_objects);
+			stats->peak_bytes = MAX(stats->peak_bytes, local->stats.peak_bytes);
+			stats->chunk_bytes += local->stats.chunk_bytes;
+			stats->inherited += local->stats.inherited;
+		}
+	} else {
+		owner = mempool_lock(owner);
+		*stats = pool->stats;
+		mempool_unlock(owner);
+	}
+}
+
+void
+mempool_collect_sites(struct Mempool *pool, struct Map *sites, struct Mempool *tmp)
+{
+	if (pool->sites) {
+		MAP_FOREACH(pool->sites, const char *, callsite, struct MempoolSite *, site) {
+			struct MempoolSite *total = map_get(sites, callsite);
+			if (total == NULL) {
+				total = mempool_alloc(tmp, sizeof(struct MempoolSite));
+				total->callsite = callsite;
+				map_add(sites, total->callsite, total);
+			}
+			total->allocations += site->allocations;
+			total->bytes += site->bytes;
+			total->live += site->live;
+		}
+	}
+	for (struct MempoolNode *node = pool->head; node; node = node->next) {
+		if (node->freefn == mempool_free_inherited) {
+			mempool_collect_sites(node->ptr, sites, tmp);
+		}
+	}
+}
+
+int
+mempool_site_compare(const void *ap, const void *bp, void *userdata)
+{
+	const struct MempoolSite *a = *(const struct MempoolSite **)ap;
+	const struct MempoolSite *b = *(const struct MempoolSite **)bp;
+	if (a->bytes > b->bytes) {
+		return -1;
+	} else if (a->bytes < b->bytes) {
+		return 1;
+	} else {
+		return strcmp(a->callsite, b->callsite);
+	}
+}
+
+void
+mempool_dump(struct Mempool *pool, FILE *fp)
+{
+	struct MempoolStats stats;
+	mempool_stats(pool, &stats);
+	fprintf(fp, "objects: %zu (peak %zu)\n", stats.objects, stats.peak_objects);
+	fprintf(fp, "bytes: %zu (peak %zu)\n", stats.bytes, stats.peak_bytes);
+	fprintf(fp, "chunk bytes: %zu\n", stats.chunk_bytes);
+	fprintf(fp, "inherited pools: %zu\n", stats.inherited);
+	if (pool == NULL) {
+		return;
+	}
+
+	SCOPE_MEMPOOL(tmp);
+	struct Map *sites = mempool_map_hash(tmp, str_hash, str_compare, NULL, NULL, NULL);
+	struct Mempool *owner = mempool_owner(pool);
+	if (owner->local) {
+		struct Mempool *local = __atomic_load_n(&owner->locals, __ATOMIC_ACQUIRE);
+		for (; local; local = local->next_local) {
+			mempool_collect_sites(local, sites, tmp);
+		}
+	} else {
+		owner = mempool_lock(owner);
+		mempool_collect_sites(pool, sites, tmp);
+		mempool_unlock(owner);
+	}
+
+	struct Array *values = map_values(sites, tmp);
+	array_sort(values, mempool_site_compare, NULL);
+	ARRAY_FOREACH(values, struct MempoolSite *, site) {
+		fprintf(fp, "%zu bytes in %zu allocations (%zu live) at %s\n", site->bytes, site->allocations, site->live, site->callsite);
+	}
 }
 
 void *
 mempool_take(struct Mempool *pool, void *ptr)
 {
-	return mempool_add(pool, ptr, free);
+	return mempool_add_at(pool, NULL, ptr, free);
+}
+
+void *
+mempool_take_at(struct Mempool *pool, const char *callsite, void *ptr)
+{
+	return mempool_add_at(pool, callsite, ptr, free);
 }
 
 struct Array *
 mempool_array(struct Mempool *pool)
 {
-	return mempool_add(pool, array_new(), array_free);
+	return mempool_array_at(pool, NULL);
+}
+
+struct Array *
+mempool_array_at(struct Mempool *pool, const char *callsite)
+{
+	const struct Allocator *prev = mempool_use_allocator(pool);
+	struct Array *array = array_new();
+	allocator_use(prev);
+	return mempool_add_at(pool, callsite, array, array_free);
+}
+
+struct Array *
+mempool_array_sized(struct Mempool *pool, size_t value_size)
+{
+	return mempool_array_sized_at(pool, NULL, value_size);
+}
+
+struct Array *
+mempool_array_sized_at(struct Mempool *pool, const char *callsite, size_t value_size)
+{
+	const struct Allocator *prev = mempool_use_allocator(pool);
+	struct Array *array = array_new_sized(value_size);
+	allocator_use(prev);
+	return mempool_add_at(pool, callsite, array, array_free);
+}
+
+struct Heap *
+mempool_heap(struct Mempool *pool, MempoolCompareFn compare, void *compare_userdata)
+{
+	return mempool_heap_at(pool, NULL, compare, compare_userdata);
+}
+
+struct Heap *
+mempool_heap_at(struct Mempool *pool, const char *callsite, MempoolCompareFn compare, void *compare_userdata)
+{
+	const struct Allocator *prev = mempool_use_allocator(pool);
+	struct Heap *heap = heap_new(compare, compare_userdata);
+	allocator_use(prev);
+	return mempool_add_at(pool, callsite, heap, heap_free);
 }
 
 struct Map *
 mempool_map(struct Mempool *pool, MempoolCompareFn compare, void *compare_userdata, void *keyfree, void *valuefree)
 {
-	return mempool_add(pool, map_new(compare, compare_userdata, keyfree, valuefree), map_free);
+	return mempool_map_at(pool, NULL, compare, compare_userdata, keyfree, valuefree);
+}
+
+struct Map *
+mempool_map_at(struct Mempool *pool, const char *callsite, MempoolCompareFn compare, void *compare_userdata, void *keyfree, void *valuefree)
+{
+	const struct Allocator *prev = mempool_use_allocator(pool);
+	struct Map *map = map_new(compare, compare_userdata, keyfree, valuefree);
+	allocator_use(prev);
+	return mempool_add_at(pool, callsite, map, map_free);
+}
+
+struct Map *
+mempool_map_hash(struct Mempool *pool, MempoolHashFn hash, MempoolCompareFn compare, void *compare_userdata, void *keyfree, void *valuefree)
+{
+	return mempool_map_hash_at(pool, NULL, hash, compare, compare_userdata, keyfree, valuefree);
+}
+
+struct Map *
+mempool_map_hash_at(struct Mempool *pool, const char *callsite, MempoolHashFn hash, MempoolCompareFn compare, void *compare_userdata, void *keyfree, void *valuefree)
+{
+	const struct Allocator *prev = mempool_use_allocator(pool);
+	struct Map *map = map_new_hash(hash, compare, compare_userdata, keyfree, valuefree);
+	allocator_use(prev);
+	return mempool_add_at(pool, callsite, map, map_free);
+}
+
+struct Map *
+mempool_map_btree(struct Mempool *pool, MempoolCompareFn compare, void *compare_userdata, void *keyfree, void *valuefree)
+{
+	return mempool_map_btree_at(pool, NULL, compare, compare_userdata, keyfree, valuefree);
+}
+
+struct Map *
+mempool_map_btree_at(struct Mempool *pool, const char *callsite, MempoolCompareFn compare, void *compare_userdata, void *keyfree, void *valuefree)
+{
+	const struct Allocator *prev = mempool_use_allocator(pool);
+	struct Map *map = map_new_btree(compare, compare_userdata, keyfree, valuefree);
+	allocator_use(prev);
+	return mempool_add_at(pool, callsite, map, map_free);
+}
+
+struct Objpool *
+mempool_objpool(struct Mempool *pool, size_t size)
+{
+	return mempool_objpool_at(pool, NULL, size);
+}
+
+struct Objpool *
+mempool_objpool_at(struct Mempool *pool, const char *callsite, size_t size)
+{
+	const struct Allocator *prev = mempool_use_allocator(pool);
+	struct Objpool *objpool = objpool_new(size);
+	allocator_use(prev);
+	return mempool_add_at(pool, callsite, objpool, objpool_free);
 }
 
 struct Queue *
 mempool_queue(struct Mempool *pool)
 {
-	return mempool_add(pool, queue_new(), queue_free);
+	return mempool_queue_at(pool, NULL);
+}
+
+struct Queue *
+mempool_queue_at(struct Mempool *pool, const char *callsite)
+{
+	const struct Allocator *prev = mempool_use_allocator(pool);
+	struct Queue *queue = queue_new();
+	allocator_use(prev);
+	return mempool_add_at(pool, callsite, queue, queue_free);
 }
 
 struct Set *
 mempool_set(struct Mempool *pool, MempoolCompareFn compare, void *compare_userdata, void *keyfree)
 {
-	return mempool_add(pool, set_new(compare, compare_userdata, keyfree), set_free);
+	return mempool_set_at(pool, NULL, compare, compare_userdata, keyfree);
+}
+
+struct Set *
+mempool_set_at(struct Mempool *pool, const char *callsite, MempoolCompareFn compare, void *compare_userdata, void *keyfree)
+{
+	const struct Allocator *prev = mempool_use_allocator(pool);
+	struct Set *set = set_new(compare, compare_userdata, keyfree);
+	allocator_use(prev);
+	return mempool_add_at(pool, callsite, set, set_free);
 }
 
 struct Stack *
 mempool_stack(struct Mempool *pool)
 {
-	return mempool_add(pool, stack_new(), stack_free);
+	return mempool_stack_at(pool, NULL);
+}
+
+struct Stack *
+mempool_stack_at(struct Mempool *pool, const char *callsite)
+{
+	const struct Allocator *prev = mempool_use_allocator(pool);
+	struct Stack *stack = stack_new();
+	allocator_use(prev);
+	return mempool_add_at(pool, callsite, stack, stack_free);
 }
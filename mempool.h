@@ -28,29 +28,108 @@
 #pragma once
 
 struct Mempool;
+struct MempoolChunk;
+
+struct MempoolMark {
+	size_t seq;
+	struct MempoolChunk *chunks;
+	struct MempoolChunk *current;
+	size_t used;
+};
+
+struct MempoolStats {
+	size_t objects;
+	size_t bytes;
+	size_t peak_objects;
+	size_t peak_bytes;
+	size_t chunk_bytes;
+	size_t inherited;
+};
 
 typedef int (*MempoolCompareFn)(const void *, const void *, void *);
+typedef uint64_t (*MempoolHashFn)(const void *, void *);
 
 struct Mempool *mempool_new(void);
+struct Mempool *mempool_new_arena(void);
+struct Mempool *mempool_new_concurrent(void);
+struct Mempool *mempool_new_local(void);
 struct Mempool *mempool_new_unique(void);
 void mempool_free(struct Mempool *);
+// Frees the pool on a background thread.  NULL is ignored and
+// inherited pools are freed together with their owner, just like
+// with mempool_free().  mempool_drain() waits for queued pools.
+void mempool_free_async(struct Mempool *);
+void mempool_drain(void);
 void mempool_cleanup(struct Mempool **);
 void mempool_inherit(struct Mempool *, struct Mempool *);
 void mempool_release_all(struct Mempool *);
+struct MempoolMark mempool_mark(struct Mempool *);
+void mempool_rollback(struct Mempool *, struct MempoolMark);
+void mempool_profile(struct Mempool *);
+void mempool_stats(struct Mempool *, struct MempoolStats *);
 
 void *mempool_add(struct Mempool *, void *, void *);
 void *mempool_alloc(struct Mempool *, size_t);
+void *mempool_alloc_uninit(struct Mempool *, size_t);
+// Memory that arena pools hand out from mempool_alloc() has no owner
+// of its own and lives until the pool is freed or rolled back.
+// Passing it to mempool_forget(), mempool_move() or mempool_release()
+// aborts.
 void *mempool_forget(struct Mempool *, void *);
 void *mempool_move(struct Mempool *, void *, struct Mempool *);
 void *mempool_release(struct Mempool *, void *);
 void *mempool_take(struct Mempool *, void *);
 
 struct Array *mempool_array(struct Mempool *);
+struct Array *mempool_array_sized(struct Mempool *, size_t);
+struct Heap *mempool_heap(struct Mempool *, MempoolCompareFn, void *);
 struct Map *mempool_map(struct Mempool *, MempoolCompareFn, void *, void *, void *);
+struct Map *mempool_map_hash(struct Mempool *, MempoolHashFn, MempoolCompareFn, void *, void *, void *);
+struct Map *mempool_map_btree(struct Mempool *, MempoolCompareFn, void *, void *, void *);
+struct Objpool *mempool_objpool(struct Mempool *, size_t);
 struct Queue *mempool_queue(struct Mempool *);
 struct Set *mempool_set(struct Mempool *, MempoolCompareFn, void *, void *);
 struct Stack *mempool_stack(struct Mempool *);
 
+// The _at variants attribute what they allocate to the given callsite
+// in profiled pools.  With MEMPOOL_CALLSITES defined the plain names
+// pass MEMPOOL_CALLSITE to them.
+void *mempool_add_at(struct Mempool *, const char *, void *, void *);
+void *mempool_alloc_at(struct Mempool *, const char *, size_t);
+void *mempool_alloc_uninit_at(struct Mempool *, const char *, size_t);
+void *mempool_take_at(struct Mempool *, const char *, void *);
+struct Array *mempool_array_at(struct Mempool *, const char *);
+struct Array *mempool_array_sized_at(struct Mempool *, const char *, size_t);
+struct Heap *mempool_heap_at(struct Mempool *, const char *, MempoolCompareFn, void *);
+struct Map *mempool_map_at(struct Mempool *, const char *, MempoolCompareFn, void *, void *, void *);
+struct Map *mempool_map_hash_at(struct Mempool *, const char *, MempoolHashFn, MempoolCompareFn, void *, void *, void *);
+struct Map *mempool_map_btree_at(struct Mempool *, const char *, MempoolCompareFn, void *, void *, void *);
+struct Objpool *mempool_objpool_at(struct Mempool *, const char *, size_t);
+struct Queue *mempool_queue_at(struct Mempool *, const char *);
+struct Set *mempool_set_at(struct Mempool *, const char *, MempoolCompareFn, void *, void *);
+struct Stack *mempool_stack_at(struct Mempool *, const char *);
+
 #define SCOPE_MEMPOOL(x) \
 	struct Mempool *x __cleanup(mempool_cleanup) = mempool_new()
 
+#define MEMPOOL_CALLSITE_STR(x) #x
+#define MEMPOOL_CALLSITE_LINE(x) MEMPOOL_CALLSITE_STR(x)
+#define MEMPOOL_CALLSITE __FILE__ ":" MEMPOOL_CALLSITE_LINE(__LINE__)
+
+#if defined(MEMPOOL_CALLSITES)
+#define mempool_add(pool, ...) mempool_add_at(pool, MEMPOOL_CALLSITE, __VA_ARGS__)
+#define mempool_alloc(pool, ...) mempool_alloc_at(pool, MEMPOOL_CALLSITE, __VA_ARGS__)
+#define mempool_alloc_uninit(pool, ...) mempool_alloc_uninit_at(pool, MEMPOOL_CALLSITE, __VA_ARGS__)
+#define mempool_take(pool, ...) mempool_take_at(pool, MEMPOOL_CALLSITE, __VA_ARGS__)
+#define mempool_array(pool) mempool_array_at(pool, MEMPOOL_CALLSITE)
+#define mempool_array_sized(pool, ...) mempool_array_sized_at(pool, MEMPOOL_CALLSITE, __VA_ARGS__)
+#define mempool_heap(pool, ...) mempool_heap_at(pool, MEMPOOL_CALLSITE, __VA_ARGS__)
+#define mempool_map(pool, ...) mempool_map_at(pool, MEMPOOL_CALLSITE, __VA_ARGS__)
+#define mempool_map_hash(pool, ...) mempool_map_hash_at(pool, MEMPOOL_CALLSITE, __VA_ARGS__)
+#define mempool_map_btree(pool, ...) mempool_map_btree_at(pool, MEMPOOL_CALLSITE, __VA_ARGS__)
+#define mempool_objpool(pool, ...) mempool_objpool_at(pool, MEMPOOL_CALLSITE, __VA_ARGS__)
+#define mempool_queue(pool) mempool_queue_at(pool, MEMPOOL_CALLSITE)
+#define mempool_set(pool, ...) mempool_set_at(pool, MEMPOOL_CALLSITE, __VA_ARGS__)
+#define mempool_stack(pool) mempool_stack_at(pool, MEMPOOL_CALLSITE)
+#endif
+
@@ -32,3 +32,4 @@ struct Mempool;
 FILE *mempool_fopenat(struct Mempool *, int, const char *, const char *, mode_t);
 int mempool_openat(struct Mempool *, int, const char *, int, mode_t);
 int mempool_takefd(struct Mempool *, int);
+void mempool_dump(struct Mempool *, FILE *);
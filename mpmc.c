@@ -0,0 +1,299 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2020 Tobias Kortkamp <tobik@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#if HAVE_ERR
+# include <err.h>
+#endif
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mpmc.h"
+#include "util.h"
+
+// Bounded multi-producer/multi-consumer queue after Dmitry Vyukov.
+// Every cell carries a sequence number that tells producers and
+// consumers whether it is their turn.  Positions are claimed by
+// advancing head or tail with a CAS, so the queue is lock-free as long
+// as nobody has to block.  The mutex and condition variables are only
+// touched when a thread announced that it is waiting.
+
+#define MPMC_CACHELINE 64
+
+struct MPMCCell {
+	size_t seq;
+	void *value;
+};
+
+struct MPMC {
+	struct MPMCCell *cells;
+	size_t mask;
+	size_t head __attribute__((aligned(MPMC_CACHELINE)));
+	size_t tail __attribute__((aligned(MPMC_CACHELINE)));
+	size_t producers_waiting __attribute__((aligned(MPMC_CACHELINE)));
+	size_t consumers_waiting;
+	int closed;
+	pthread_mutex_t mtx;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+};
+
+static size_t mpmc_claim(struct MPMC *, size_t *, size_t, size_t, size_t *);
+static size_t mpmc_dequeue(struct MPMC *, void **, size_t);
+static size_t mpmc_enqueue(struct MPMC *, void **, size_t);
+static void mpmc_wakeup(struct MPMC *, size_t *, pthread_cond_t *);
+
+struct MPMC *
+mpmc_new(size_t capacity)
+{
+	size_t cap = 2;
+	while (cap < capacity) {
+		cap *= 2;
+	}
+
+	struct MPMC *queue;
+	if ((errno = posix_memalign((void **)&queue, MPMC_CACHELINE, sizeof(struct MPMC))) != 0) {
+		warn("posix_memalign");
+		abort();
+	}
+	memset(queue, 0, sizeof(struct MPMC));
+	queue->cells = xrecallocarray(NULL, 0, cap, sizeof(struct MPMCCell));
+	for (size_t i = 0; i < cap; i++) {
+		queue->cells[i].seq = i;
+	}
+	queue->mask = cap - 1;
+	pthread_mutex_init(&queue->mtx, NULL);
+	pthread_cond_init(&queue->not_empty, NULL);
+	pthread_cond_init(&queue->not_full, NULL);
+	return queue;
+}
+
+void
+mpmc_free(struct MPMC *queue)
+{
+	if (queue == NULL) {
+		return;
+	}
+
+	pthread_cond_destroy(&queue->not_full);
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_mutex_destroy(&queue->mtx);
+	free(queue->cells);
+	free(queue);
+}
+
+size_t
+mpmc_capacity(struct MPMC *queue)
+{
+	return queue->mask + 1;
+}
+
+void
+mpmc_close(struct MPMC *queue)
+{
+	pthread_mutex_lock(&queue->mtx);
+	__atomic_store_n(&queue->closed, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&queue->not_empty);
+	pthread_cond_broadcast(&queue->not_full);
+	pthread_mutex_unlock(&queue->mtx);
+}
+
+// Claims up to n consecutive cells at *counter whose sequence number
+// is their position plus offset, i.e. cells that are free for
+// producers (offset 0) or filled for consumers (offset 1).  Returns
+// the number of claimed cells and sets *first to the position of the
+// first of them.
+size_t
+mpmc_claim(struct MPMC *queue, size_t *counter, size_t offset, size_t n, size_t *first)
+{
+	size_t pos = __atomic_load_n(counter, __ATOMIC_RELAXED);
+	for (;;) {
+		size_t ready = 0;
+		while (ready < n && ready <= queue->mask) {
+			struct MPMCCell *cell = &queue->cells[(pos + ready) & queue->mask];
+			if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + ready + offset) {
+				break;
+			}
+			ready++;
+		}
+
+		if (ready == 0) {
+			struct MPMCCell *cell = &queue->cells[pos & queue->mask];
+			intptr_t diff = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + offset);
+			if (diff < 0) {
+				// Full for producers or empty for consumers
+				return 0;
+			}
+			// Another thread claimed the cell since pos was loaded
+			pos = __atomic_load_n(counter, __ATOMIC_RELAXED);
+		} else if (__atomic_compare_exchange_n(counter, &pos, pos + ready, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			*first = pos;
+			return ready;
+		}
+	}
+}
+
+void
+mpmc_wakeup(struct MPMC *queue, size_t *waiting, pthread_cond_t *cond)
+{
+	// Pairs with the increment of the waiting counter in
+	// mpmc_push_wait() and mpmc_pop_wait(), so that either the
+	// waiter sees the new cells or we see the waiter.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiting, __ATOMIC_RELAXED) > 0) {
+		pthread_mutex_lock(&queue->mtx);
+		pthread_cond_broadcast(cond);
+		pthread_mutex_unlock(&queue->mtx);
+	}
+}
+
+size_t
+mpmc_enqueue(struct MPMC *queue, void **values, size_t n)
+{
+	size_t pos;
+	size_t claimed = mpmc_claim(queue, &queue->head, 0, n, &pos);
+	for (size_t i = 0; i < claimed; i++) {
+		struct MPMCCell *cell = &queue->cells[(pos + i) & queue->mask];
+		cell->value = values[i];
+		__atomic_store_n(&cell->seq, pos + i + 1, __ATOMIC_RELEASE);
+	}
+	return claimed;
+}
+
+size_t
+mpmc_dequeue(struct MPMC *queue, void **values, size_t n)
+{
+	size_t pos;
+	size_t claimed = mpmc_claim(queue, &queue->tail, 1, n, &pos);
+	for (size_t i = 0; i < claimed; i++) {
+		struct MPMCCell *cell = &queue->cells[(pos + i) & queue->mask];
+		values[i] = cell->value;
+		__atomic_store_n(&cell->seq, pos + i + queue->mask + 1, __ATOMIC_RELEASE);
+	}
+	return claimed;
+}
+
+size_t
+mpmc_push_batch(struct MPMC *queue, void **values, size_t n)
+{
+	size_t pushed = mpmc_enqueue(queue, values, n);
+	if (pushed > 0) {
+		mpmc_wakeup(queue, &queue->consumers_waiting, &queue->not_empty);
+	}
+	return pushed;
+}
+
+int
+mpmc_push(struct MPMC *queue, const void *value)
+{
+	void *values[] = { (void *)value };
+	return mpmc_push_batch(queue, values, 1) == 1;
+}
+
+size_t
+mpmc_pop_batch(struct MPMC *queue, void **values, size_t n)
+{
+	size_t popped = mpmc_dequeue(queue, values, n);
+	if (popped > 0) {
+		mpmc_wakeup(queue, &queue->producers_waiting, &queue->not_full);
+	}
+	return popped;
+}
+
+void *
+mpmc_pop(struct MPMC *queue)
+{
+	void *value;
+	if (mpmc_pop_batch(queue, &value, 1) == 1) {
+		return value;
+	} else {
+		return NULL;
+	}
+}
+
+int
+mpmc_push_wait(struct MPMC *queue, const void *value)
+{
+	for (;;) {
+		if (__atomic_load_n(&queue->closed, __ATOMIC_RELAXED)) {
+			return 0;
+		} else if (mpmc_push(queue, value)) {
+			return 1;
+		}
+
+		// Announce ourselves before the last attempt so that a
+		// consumer that frees a cell afterwards sees us waiting
+		void *values[] = { (void *)value };
+		pthread_mutex_lock(&queue->mtx);
+		__atomic_add_fetch(&queue->producers_waiting, 1, __ATOMIC_SEQ_CST);
+		size_t pushed = mpmc_enqueue(queue, values, 1);
+		if (pushed == 0 && !queue->closed) {
+			pthread_cond_wait(&queue->not_full, &queue->mtx);
+		}
+		__atomic_sub_fetch(&queue->producers_waiting, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&queue->mtx);
+		if (pushed > 0) {
+			mpmc_wakeup(queue, &queue->consumers_waiting, &queue->not_empty);
+			return 1;
+		}
+	}
+}
+
+void *
+mpmc_pop_wait(struct MPMC *queue)
+{
+	for (;;) {
+		void *value;
+		if (mpmc_pop_batch(queue, &value, 1) == 1) {
+			return value;
+		} else if (__atomic_load_n(&queue->closed, __ATOMIC_SEQ_CST)) {
+			// Drain whatever was pushed before the queue was closed
+			if (mpmc_pop_batch(queue, &value, 1) == 1) {
+				return value;
+			}
+			return NULL;
+		}
+
+		pthread_mutex_lock(&queue->mtx);
+		__atomic_add_fetch(&queue->consumers_waiting, 1, __ATOMIC_SEQ_CST);
+		size_t popped = mpmc_dequeue(queue, &value, 1);
+		if (popped == 0 && !queue->closed) {
+			pthread_cond_wait(&queue->not_empty, &queue->mtx);
+		}
+		__atomic_sub_fetch(&queue->consumers_waiting, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&queue->mtx);
+		if (popped > 0) {
+			mpmc_wakeup(queue, &queue->producers_waiting, &queue->not_full);
+			return value;
+		}
+	}
+}
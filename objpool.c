@@ -0,0 +1,142 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2020 Tobias Kortkamp <tobik@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <sys/param.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "objpool.h"
+#include "util.h"
+
+// Objects are carved from chunks that double in size.  Released
+// objects are put on a free list that is threaded through the objects
+// themselves and reused before carving new ones.  Memory is only
+// returned to the system by objpool_truncate() and objpool_free().
+
+#define OBJPOOL_ALIGN 16
+#define OBJPOOL_CHUNK_MIN 16
+#define OBJPOOL_CHUNK_MAX 4096
+
+struct ObjpoolChunk {
+	struct ObjpoolChunk *next;
+	size_t len;
+	size_t cap;
+	char data[] __attribute__((aligned(OBJPOOL_ALIGN)));
+};
+
+struct Objpool {
+	size_t size;
+	size_t len;
+	struct ObjpoolChunk *chunks;
+	void *freelist;
+	const struct Allocator *allocator;
+};
+
+struct Objpool *
+objpool_new(size_t size)
+{
+	const struct Allocator *allocator = allocator_current();
+	struct Objpool *pool = allocator_alloc(allocator, sizeof(struct Objpool));
+	pool->allocator = allocator;
+	// Objects must be able to hold the free list link.  Rounding
+	// up to a multiple of the pointer size keeps them aligned since
+	// the size of a type is always a multiple of its alignment.
+	size = MAX(size, sizeof(void *));
+	pool->size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	return pool;
+}
+
+void
+objpool_free(struct Objpool *pool)
+{
+	if (pool == NULL) {
+		return;
+	}
+
+	objpool_truncate(pool);
+	allocator_free(pool->allocator, pool);
+}
+
+void *
+objpool_alloc(struct Objpool *pool)
+{
+	void *obj = pool->freelist;
+	if (obj) {
+		pool->freelist = *(void **)obj;
+		memset(obj, 0, pool->size);
+	} else {
+		struct ObjpoolChunk *chunk = pool->chunks;
+		if (chunk == NULL || chunk->len == chunk->cap) {
+			size_t cap = OBJPOOL_CHUNK_MIN;
+			if (chunk) {
+				cap = MIN(chunk->cap * 2, OBJPOOL_CHUNK_MAX);
+			}
+			chunk = allocator_alloc(pool->allocator, sizeof(struct ObjpoolChunk) + cap * pool->size);
+			chunk->cap = cap;
+			chunk->next = pool->chunks;
+			pool->chunks = chunk;
+		}
+		obj = chunk->data + chunk->len++ * pool->size;
+	}
+
+	pool->len++;
+	return obj;
+}
+
+size_t
+objpool_len(struct Objpool *pool)
+{
+	return pool->len;
+}
+
+void
+objpool_release(struct Objpool *pool, void *obj)
+{
+	if (obj) {
+		*(void **)obj = pool->freelist;
+		pool->freelist = obj;
+		pool->len--;
+	}
+}
+
+void
+objpool_truncate(struct Objpool *pool)
+{
+	struct ObjpoolChunk *chunk = pool->chunks;
+	while (chunk) {
+		struct ObjpoolChunk *next = chunk->next;
+		allocator_free(pool->allocator, chunk);
+		chunk = next;
+	}
+	pool->chunks = NULL;
+	pool->freelist = NULL;
+	pool->len = 0;
+}
@@ -39,6 +39,7 @@
 
 #include "array.h"
 #include "mempool.h"
+#include "objpool.h"
 #include "peg.h"
 #include "queue.h"
 #include "set.h"
@@ -67,6 +68,7 @@ struct PEG {
 		struct Set *set;
 		struct Queue *queue;
 		struct Stack *pos;
+		struct Objpool *objpool;
 		int enabled;
 	} captures;
 
@@ -96,7 +98,7 @@ do { \
 	for (size_t i = MATCHER_INIT_captures_queue_len; i < queue_len(peg->captures.queue); i++) { \
 		struct PEGCapture *capture = queue_dequeue(peg->captures.queue); \
 		set_remove(peg->captures.set, capture); \
-		free(capture); \
+		objpool_release(peg->captures.objpool, capture); \
 	} \
 	if (peg->debug) { \
 		for (size_t i = MATCHER_INIT_rule_trace_len; i < queue_len(peg->rule_trace); i++) { \
@@ -142,8 +144,8 @@ compare_capture(const void *ap, const void *bp, void *userdata)
 static int
 compare_error(const void *ap, const void *bp, void *userdata)
 {
-	struct PEGError *a = *(struct PEGError **)ap;
-	struct PEGError *b = *(struct PEGError **)bp;
+	const struct PEGError *a = ap;
+	const struct PEGError *b = bp;
 	if (a->pos < b->pos) {
 		return 1;
 	} else if (a->pos > b->pos) {
@@ -174,7 +176,6 @@ peg_match(struct PEG *peg, RuleFn rulefn, CaptureFn capture_machine, void *userd
 		int stop = 0;
 		struct PEGCapture *capture;
 		while (!stop && (capture = queue_pop(peg->captures.queue))) {
-			mempool_take(peg->pool, capture);
 			switch (capture_machine(capture, userdata)) {
 			case PEG_CAPTURE_CONTINUE:
 				break;
@@ -185,11 +186,11 @@ peg_match(struct PEG *peg, RuleFn rulefn, CaptureFn capture_machine, void *userd
 		}
 		if (stop) {
 			while ((capture = queue_pop(peg->captures.queue))) {
-				free(capture);
+				objpool_release(peg->captures.objpool, capture);
 			}
 			result = 0;
 		} else {
-			capture = mempool_alloc(peg->pool, sizeof(struct PEGCapture));
+			capture = objpool_alloc(peg->captures.objpool);
 			capture->peg = peg;
 			capture->buf = peg->buf;
 			capture->pos = 0;
@@ -268,7 +269,7 @@ peg_match_capture_end(struct PEG *peg, unsigned int tag, unsigned int state, int
 			size_t len = peg->pos - start;
 			struct PEGCapture c = { .tag = tag, .state = state, .pos = start, .len = len };
 			if (!set_get(peg->captures.set, &c)) {
-				struct PEGCapture *capture = xmalloc(sizeof(struct PEGCapture));
+				struct PEGCapture *capture = objpool_alloc(peg->captures.objpool);
 				capture->tag = tag;
 				capture->state = state;
 				capture->buf = peg->buf + start;
@@ -522,15 +523,14 @@ peg_new(const char *const buf, size_t len)
 		.buf = buf,
 		.len = len,
 	};
-	struct PEG *peg = xmalloc(sizeof(struct PEG));
+	struct Mempool *pool = mempool_new();
+	struct PEG *peg = mempool_alloc_uninit(pool, sizeof(struct PEG));
 	memcpy(peg, &proto, sizeof(*peg));
+	peg->pool = pool;
 
-	peg->pool = mempool_new();
-	mempool_take(peg->pool, peg);
-
-	peg->errors = mempool_array(peg->pool);
+	peg->errors = mempool_array_sized(peg->pool, sizeof(struct PEGError));
 	for (size_t i = 0; i < PEG_MAX_ERRORS; i++) {
-		array_append(peg->errors, mempool_alloc(peg->pool, sizeof(struct PEGError)));
+		array_append_value(peg->errors, NULL);
 	}
 
 	peg->debug = getenv("LIBIAS_PEG_DEBUG") != NULL;
@@ -539,6 +539,7 @@ peg_new(const char *const buf, size_t len)
 	peg->captures.set = mempool_set(peg->pool, compare_capture, peg, NULL);
 	peg->captures.queue = mempool_queue(peg->pool);
 	peg->captures.pos = mempool_stack(peg->pool);
+	peg->captures.objpool = mempool_objpool(peg->pool, sizeof(struct PEGCapture));
 
 	return peg;
 }
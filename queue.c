@@ -28,27 +28,34 @@
 
 #include "config.h"
 
+#include <sys/param.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "allocator.h"
 #include "queue.h"
 #include "util.h"
 
-struct QueueNode {
-	struct QueueNode *next;
-	struct QueueNode *prev;
-	void *value;
-};
-
+// Ring buffer with a power-of-two capacity.  head is the index of
+// the front element; elements are at (head + i) & (cap - 1).
 struct Queue {
+	void **buf;
+	size_t cap;
+	size_t head;
 	size_t len;
-	struct QueueNode *head;
-	struct QueueNode *tail;
+	const struct Allocator *allocator;
 };
 
+static const size_t INITIAL_QUEUE_CAP = 16;
+
+static void queue_grow(struct Queue *);
+
 struct Queue *
 queue_new()
 {
-	struct Queue *queue = xmalloc(sizeof(struct Queue));
+	const struct Allocator *allocator = allocator_current();
+	struct Queue *queue = allocator_alloc(allocator, sizeof(struct Queue));
+	queue->allocator = allocator;
 	return queue;
 }
 
@@ -59,13 +66,25 @@ queue_free(struct Queue *queue)
 		return;
 	}
 
-	struct QueueNode *node = queue->head;
-	while (node) {
-		struct QueueNode *next = node->next;
-		free(node);
-		node = next;
+	allocator_free(queue->allocator, queue->buf);
+	allocator_free(queue->allocator, queue);
+}
+
+void
+queue_grow(struct Queue *queue)
+{
+	size_t cap = queue->cap ? queue->cap * 2 : INITIAL_QUEUE_CAP;
+	void **buf = allocator_recallocarray(queue->allocator, NULL, 0, cap, sizeof(void *));
+	// Unwrap the elements to the start of the new buffer
+	size_t first = MIN(queue->len, queue->cap - queue->head);
+	if (first > 0) {
+		memcpy(buf, queue->buf + queue->head, first * sizeof(void *));
+		memcpy(buf + first, queue->buf, (queue->len - first) * sizeof(void *));
 	}
-	free(queue);
+	allocator_free(queue->allocator, queue->buf);
+	queue->buf = buf;
+	queue->cap = cap;
+	queue->head = 0;
 }
 
 size_t
@@ -77,8 +96,8 @@ queue_len(struct Queue *queue)
 int
 queue_contains(struct Queue *queue, const void *value)
 {
-	for (struct QueueNode *node = queue->head; node; node = node->next) {
-		if (value == node->value) {
+	for (size_t i = 0; i < queue->len; i++) {
+		if (value == queue->buf[(queue->head + i) & (queue->cap - 1)]) {
 			return 1;
 		}
 	}
@@ -88,8 +107,18 @@ queue_contains(struct Queue *queue, const void *value)
 void *
 queue_peek(struct Queue *queue)
 {
-	if (queue->head) {
-		return queue->head->value;
+	if (queue->len > 0) {
+		return queue->buf[queue->head];
+	} else {
+		return NULL;
+	}
+}
+
+void *
+queue_peek_back(struct Queue *queue)
+{
+	if (queue->len > 0) {
+		return queue->buf[(queue->head + queue->len - 1) & (queue->cap - 1)];
 	} else {
 		return NULL;
 	}
@@ -98,19 +127,9 @@ queue_peek(struct Queue *queue)
 void *
 queue_pop(struct Queue *queue)
 {
-	if (queue->head) {
-		void *value = queue->head->value;
-		struct QueueNode *next = queue->head->next;
-		free(queue->head);
-		queue->head = next;
-		if (queue->head) {
-			queue->head->prev = NULL;
-			if (queue->head->next == NULL) {
-				queue->tail = queue->head;
-			}
-		} else {
-			queue->tail = NULL;
-		}
+	if (queue->len > 0) {
+		void *value = queue->buf[queue->head];
+		queue->head = (queue->head + 1) & (queue->cap - 1);
 		queue->len--;
 		return value;
 	} else {
@@ -121,49 +140,58 @@ queue_pop(struct Queue *queue)
 void
 queue_push(struct Queue *queue, const void *value)
 {
-	struct QueueNode *node = xmalloc(sizeof(struct QueueNode));
-	node->value = (void *)value;
-	if (queue->tail) {
-		queue->tail->next = node;
-		node->prev = queue->tail;
-		queue->tail = node;
-	} else {
-		queue->head = queue->tail = node;
+	if (queue->len == queue->cap) {
+		queue_grow(queue);
 	}
+	queue->buf[(queue->head + queue->len) & (queue->cap - 1)] = (void *)value;
+	queue->len++;
+}
+
+void
+queue_push_front(struct Queue *queue, const void *value)
+{
+	if (queue->len == queue->cap) {
+		queue_grow(queue);
+	}
+	queue->head = (queue->head - 1) & (queue->cap - 1);
+	queue->buf[queue->head] = (void *)value;
 	queue->len++;
 }
 
 void *
 queue_dequeue(struct Queue *queue)
 {
-	if (queue->tail == NULL) {
-		return NULL;
-	} else {
-		void *value = queue->tail->value;
-		struct QueueNode *newtail = queue->tail->prev;
-		if (newtail) {
-			newtail->next = NULL;
-		}
-		if (queue->tail == queue->head) {
-			queue->head = newtail;
-		}
-		free(queue->tail);
-		queue->tail = newtail;
+	if (queue->len > 0) {
 		queue->len--;
-		return value;
+		return queue->buf[(queue->head + queue->len) & (queue->cap - 1)];
+	} else {
+		return NULL;
 	}
 }
 
 void
 queue_truncate(struct Queue *queue)
 {
-	struct QueueNode *node = queue->head;
-	while (node) {
-		struct QueueNode *next = node->next;
-		free(node);
-		node = next;
-	}
-	queue->head = NULL;
-	queue->tail = NULL;
+	queue->head = 0;
 	queue->len = 0;
 }
+
+struct QueueIterator
+queue_iterator(struct Queue *queue)
+{
+	struct QueueIterator iter = { .queue = queue, .i = 0 };
+	return iter;
+}
+
+void *
+queue_iterator_next(struct QueueIterator *iter, size_t *index)
+{
+	struct Queue *queue = iter->queue;
+	if (iter->i < queue->len) {
+		*index = iter->i;
+		return queue->buf[(queue->head + iter->i++) & (queue->cap - 1)];
+	} else {
+		iter->queue = NULL;
+		return NULL;
+	}
+}
@@ -34,7 +34,22 @@ void queue_free(struct Queue *);
 size_t queue_len(struct Queue *);
 int queue_contains(struct Queue *, const void *);
 void *queue_peek(struct Queue *);
+void *queue_peek_back(struct Queue *);
 void *queue_pop(struct Queue *);
 void *queue_dequeue(struct Queue *);
 void queue_push(struct Queue *, const void *);
+void queue_push_front(struct Queue *, const void *);
 void queue_truncate(struct Queue *);
+
+struct QueueIterator {
+	struct Queue *queue;
+	size_t i;
+};
+
+struct QueueIterator queue_iterator(struct Queue *);
+void *queue_iterator_next(struct QueueIterator *, size_t *);
+
+#define QUEUE_FOREACH(QUEUE, TYPE, VAR) \
+	for (struct QueueIterator __##VAR##_iter = queue_iterator(QUEUE); __##VAR##_iter.queue != NULL; __##VAR##_iter.queue = NULL) \
+	for (size_t VAR##_index = 0; __##VAR##_iter.queue != NULL; __##VAR##_iter.queue = NULL) \
+	for (TYPE VAR = queue_iterator_next(&__##VAR##_iter, &VAR##_index); __##VAR##_iter.queue != NULL; VAR = queue_iterator_next(&__##VAR##_iter, &VAR##_index))
@@ -28,26 +28,53 @@
 
 #include "config.h"
 
+#if HAVE_ERR
+# include <err.h>
+#endif
 #include <stdlib.h>
 
+#include "allocator.h"
 #include "array.h"
-#include "map.h"
+#include "btree.h"
+#include "mempool.h"
 #include "set.h"
 #include "util.h"
 
+// Sets are B+trees of elements without values
 struct Set {
-	struct Map *map;
+	struct BTree tree;
+	void (*freefn)(void *);
+	const struct Allocator *allocator;
 };
 
-struct SetIterator {
-	struct MapIterator *iter;
+enum SetOp {
+	SET_UNION,
+	SET_INTERSECT,
+	SET_DIFFERENCE,
 };
 
+static struct Array *set_merge(struct Set *, struct Set *, enum SetOp, struct Array *);
+static void set_replace(struct Set *, struct Array *, struct Array *);
+
 struct Set *
 set_new(SetCompareFn compare, void *compare_userdata, void *freefn)
 {
-	struct Set *set = xmalloc(sizeof(struct Set));
-	set->map = map_new(compare, compare_userdata, freefn, NULL);
+	const struct Allocator *allocator = allocator_current();
+	struct Set *set = allocator_alloc(allocator, sizeof(struct Set));
+	set->allocator = allocator;
+	btree_init(&set->tree, compare, compare_userdata, allocator, 0);
+	set->freefn = freefn;
+	return set;
+}
+
+struct Set *
+set_from_sorted_array(struct Array *array, SetCompareFn compare, void *compare_userdata, void *freefn)
+{
+	struct Set *set = set_new(compare, compare_userdata, freefn);
+	if (!btree_build(&set->tree, array, NULL, set->freefn, NULL)) {
+		warnx("set_from_sorted_array: elements are not sorted");
+		abort();
+	}
 	return set;
 }
 
@@ -58,81 +85,236 @@ set_free(struct Set *set)
 		return;
 	}
 
-	map_free(set->map);
-	free(set);
+	set_truncate(set);
+	allocator_free(set->allocator, set);
 }
 
 void
 set_add(struct Set *set, const void *element)
 {
-	map_add(set->map, element, element);
+	size_t i;
+	int inserted;
+	btree_insert(&set->tree, element, &i, &inserted);
 }
 
 void
 set_remove(struct Set *set, const void *element)
 {
-	map_remove(set->map, element);
+	void *current;
+	void *value;
+	if (btree_remove(&set->tree, element, &current, &value) && set->freefn) {
+		set->freefn(current);
+	}
 }
 
 void *
 set_get(struct Set *set, const void *element)
 {
-	return map_get(set->map, element);
+	size_t i;
+	struct BTreeNode *node = btree_find(&set->tree, element, &i);
+	if (node) {
+		return node->keys[i];
+	} else {
+		return NULL;
+	}
 }
 
 int
 set_contains(struct Set *set, const void *element)
 {
-	return map_get(set->map, element) != NULL;
+	return set_get(set, element) != NULL;
 }
 
 size_t
 set_len(struct Set *set)
 {
-	return map_len(set->map);
+	return set->tree.len;
 }
 
 void
 set_truncate(struct Set *set)
 {
-	map_truncate(set->map);
+	btree_truncate(&set->tree, set->freefn, NULL);
 }
 
 struct Array *
 set_values(struct Set *set, struct Mempool *pool)
 {
-	return map_values(set->map, pool);
+	struct Array *array = mempool_array(pool);
+	array_reserve(array, set->tree.len);
+	SET_FOREACH(set, void *, element) {
+		array_append(array, element);
+	}
+	return array;
 }
 
-struct SetIterator *
-set_iterator(struct Set *set)
+// Walks both sets in order and collects the elements of the result.
+// Elements of a that are not part of the result are appended to
+// removed if it is not NULL.
+struct Array *
+set_merge(struct Set *a, struct Set *b, enum SetOp op, struct Array *removed)
 {
-	struct SetIterator *iter = xmalloc(sizeof(struct SetIterator));
-	iter->iter = map_iterator(set->map);
-	return iter;
+	struct Array *result = array_new();
+	struct SetIterator ia = set_iterator(a);
+	struct SetIterator ib = set_iterator(b);
+	size_t index;
+	void *x = set_iterator_next(&ia, &index);
+	void *y = set_iterator_next(&ib, &index);
+	while (x || y) {
+		int cmp;
+		if (x == NULL) {
+			if (op != SET_UNION) {
+				break;
+			}
+			cmp = 1;
+		} else if (y == NULL) {
+			cmp = -1;
+		} else {
+			cmp = btree_compare(&a->tree, x, y);
+		}
+
+		if (cmp < 0) {
+			if (op == SET_INTERSECT) {
+				if (removed) {
+					array_append(removed, x);
+				}
+			} else {
+				array_append(result, x);
+			}
+			x = set_iterator_next(&ia, &index);
+		} else if (cmp > 0) {
+			if (op == SET_UNION) {
+				array_append(result, y);
+			}
+			y = set_iterator_next(&ib, &index);
+		} else {
+			if (op == SET_DIFFERENCE) {
+				if (removed) {
+					array_append(removed, x);
+				}
+			} else {
+				array_append(result, x);
+			}
+			x = set_iterator_next(&ia, &index);
+			y = set_iterator_next(&ib, &index);
+		}
+	}
+	return result;
+}
+
+void
+set_replace(struct Set *set, struct Array *elements, struct Array *removed)
+{
+	// The elements are either kept or in removed, so the old nodes
+	// are freed without them.
+	btree_truncate(&set->tree, NULL, NULL);
+	btree_build(&set->tree, elements, NULL, NULL, NULL);
+	array_free(elements);
+	if (removed) {
+		if (set->freefn) {
+			ARRAY_FOREACH(removed, void *, element) {
+				set->freefn(element);
+			}
+		}
+		array_free(removed);
+	}
+}
+
+struct Set *
+set_union(struct Set *a, struct Set *b, struct Mempool *pool)
+{
+	struct Array *elements = set_merge(a, b, SET_UNION, NULL);
+	struct Set *set = set_from_sorted_array(elements, a->tree.compare, a->tree.compare_userdata, NULL);
+	array_free(elements);
+	return mempool_add(pool, set, set_free);
+}
+
+struct Set *
+set_intersect(struct Set *a, struct Set *b, struct Mempool *pool)
+{
+	struct Array *elements = set_merge(a, b, SET_INTERSECT, NULL);
+	struct Set *set = set_from_sorted_array(elements, a->tree.compare, a->tree.compare_userdata, NULL);
+	array_free(elements);
+	return mempool_add(pool, set, set_free);
+}
+
+struct Set *
+set_difference(struct Set *a, struct Set *b, struct Mempool *pool)
+{
+	struct Array *elements = set_merge(a, b, SET_DIFFERENCE, NULL);
+	struct Set *set = set_from_sorted_array(elements, a->tree.compare, a->tree.compare_userdata, NULL);
+	array_free(elements);
+	return mempool_add(pool, set, set_free);
+}
+
+void
+set_union_inplace(struct Set *a, struct Set *b)
+{
+	set_replace(a, set_merge(a, b, SET_UNION, NULL), NULL);
+}
+
+void
+set_intersect_inplace(struct Set *a, struct Set *b)
+{
+	struct Array *removed = array_new();
+	set_replace(a, set_merge(a, b, SET_INTERSECT, removed), removed);
 }
 
 void
-set_iterator_free(struct SetIterator **iter_)
+set_difference_inplace(struct Set *a, struct Set *b)
 {
-	struct SetIterator *iter = *iter_;
-	if (iter != NULL) {
-		map_iterator_free(&iter->iter);
-		free(iter);
-		*iter_ = NULL;
+	struct Array *removed = array_new();
+	set_replace(a, set_merge(a, b, SET_DIFFERENCE, removed), removed);
+}
+
+int
+set_is_subset(struct Set *a, struct Set *b)
+{
+	if (set_len(a) > set_len(b)) {
+		return 0;
 	}
+
+	struct SetIterator ia = set_iterator(a);
+	struct SetIterator ib = set_iterator(b);
+	size_t index;
+	void *x = set_iterator_next(&ia, &index);
+	void *y = set_iterator_next(&ib, &index);
+	while (x) {
+		if (y == NULL) {
+			return 0;
+		}
+		int cmp = btree_compare(&a->tree, x, y);
+		if (cmp < 0) {
+			return 0;
+		} else if (cmp == 0) {
+			x = set_iterator_next(&ia, &index);
+		}
+		y = set_iterator_next(&ib, &index);
+	}
+	return 1;
+}
+
+struct SetIterator
+set_iterator(struct Set *set)
+{
+	struct SetIterator iter = { .set = set };
+	iter.current = btree_first(&set->tree);
+	return iter;
 }
 
 void *
-set_iterator_next(struct SetIterator **iter_, size_t *index)
-{
-	void *element;
-	struct SetIterator *iter = *iter_;
-	void *next = map_iterator_next(&iter->iter, &element, index);
-	if (next == NULL) {
-		set_iterator_free(iter_);
-		*iter_ = NULL;
+set_iterator_next(struct SetIterator *iter, size_t *index)
+{
+	struct BTreeNode *node = iter->current;
+	if (node == NULL) {
+		iter->set = NULL;
 		return NULL;
 	}
-	return next;
+	*index = iter->index++;
+	void *element = node->keys[iter->slot++];
+	if (iter->slot == node->len) {
+		iter->current = node->next;
+		iter->slot = 0;
+	}
+	return element;
 }
@@ -30,10 +30,13 @@
 struct Array;
 struct Mempool;
 struct Set;
-struct SetIterator;
 typedef int (*SetCompareFn)(const void *, const void *, void *);
 
 struct Set *set_new(SetCompareFn, void *, void *);
+// Builds a set from elements in ascending order.  Elements equal to
+// the one before them are dropped and passed to freefn.  Aborts if the
+// elements are out of order.
+struct Set *set_from_sorted_array(struct Array *, SetCompareFn, void *, void *);
 void set_free(struct Set *);
 void set_add(struct Set *, const void *);
 void set_remove(struct Set *, const void *);
@@ -42,12 +45,28 @@ int set_contains(struct Set *, const void *);
 size_t set_len(struct Set *);
 void set_truncate(struct Set *);
 struct Array *set_values(struct Set *, struct Mempool *);
+// Results share their elements with the inputs and never free them.
+// The in-place variants free the elements they drop from the first set
+// and elements they add from the second set become owned by the first.
+struct Set *set_union(struct Set *, struct Set *, struct Mempool *);
+struct Set *set_intersect(struct Set *, struct Set *, struct Mempool *);
+struct Set *set_difference(struct Set *, struct Set *, struct Mempool *);
+void set_union_inplace(struct Set *, struct Set *);
+void set_intersect_inplace(struct Set *, struct Set *);
+void set_difference_inplace(struct Set *, struct Set *);
+int set_is_subset(struct Set *, struct Set *);
 
-struct SetIterator *set_iterator(struct Set *);
-void set_iterator_free(struct SetIterator **);
-void *set_iterator_next(struct SetIterator **, size_t *);
+struct SetIterator {
+	struct Set *set;
+	void *current;
+	size_t slot;
+	size_t index;
+};
+
+struct SetIterator set_iterator(struct Set *);
+void *set_iterator_next(struct SetIterator *, size_t *);
 
 #define SET_FOREACH(SET, TYPE, VAR) \
-	for (struct SetIterator *__##VAR##_iter __cleanup(set_iterator_free) = set_iterator(SET); __##VAR##_iter != NULL; set_iterator_free(&__##VAR##_iter)) \
-	for (size_t VAR##_index = 0; __##VAR##_iter != NULL; set_iterator_free(&__##VAR##_iter)) \
+	for (struct SetIterator __##VAR##_iter = set_iterator(SET); __##VAR##_iter.set != NULL; __##VAR##_iter.set = NULL) \
+	for (size_t VAR##_index = 0; __##VAR##_iter.set != NULL; __##VAR##_iter.set = NULL) \
 	for (TYPE VAR = set_iterator_next(&__##VAR##_iter, &VAR##_index); VAR != NULL; VAR = set_iterator_next(&__##VAR##_iter, &VAR##_index))
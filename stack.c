@@ -28,32 +28,24 @@
 
 #include "config.h"
 
+#include <sys/param.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "allocator.h"
 #include "stack.h"
 #include "util.h"
 
-struct Stack {
-	void **buf;
-	size_t cap;
-	size_t len;
-};
-
-struct StackIterator {
-	struct Stack *stack;
-	size_t i;
-};
-
 static const size_t INITIAL_STACK_CAP = 16;
 
 struct Stack *
 stack_new()
 {
-	struct Stack *stack = xmalloc(sizeof(struct Stack));
-	stack->cap = INITIAL_STACK_CAP;
-	stack->len = 0;
-	stack->buf = xrecallocarray(NULL, 0, stack->cap, sizeof(void *));
+	const struct Allocator *allocator = allocator_current();
+	struct Stack *stack = allocator_alloc(allocator, sizeof(struct Stack));
+	stack_init(stack);
+	stack->allocator = allocator;
 	return stack;
 }
 
@@ -64,8 +56,34 @@ stack_free(struct Stack *stack)
 		return;
 	}
 
-	free(stack->buf);
-	free(stack);
+	stack_finish(stack);
+	allocator_free(stack->allocator, stack);
+}
+
+// The allocator is picked on the first allocation unless the stack
+// was created with stack_new().
+void
+stack_init(struct Stack *stack)
+{
+	stack->buf = NULL;
+	stack->cap = 0;
+	stack->len = 0;
+	stack->allocator = NULL;
+	stack->small = NULL;
+	stack->small_cap = 0;
+}
+
+// Frees the heap buffer of the stack but not the stack itself.  A
+// stack from SCOPE_STACK goes back to its inline buffer.
+void
+stack_finish(struct Stack *stack)
+{
+	if (stack->buf != stack->small) {
+		allocator_free(stack->allocator, stack->buf);
+	}
+	stack->buf = stack->small;
+	stack->cap = stack->small_cap;
+	stack->len = 0;
 }
 
 size_t
@@ -115,17 +133,21 @@ stack_pop(struct Stack *stack)
 void
 stack_push(struct Stack *stack, const void *value)
 {
-	assert(stack->cap > 0);
-	assert(stack->cap > stack->len);
-
-	stack->buf[stack->len++] = (void *)value;
-	if (stack->len >= stack->cap) {
-		size_t new_cap = stack->cap + INITIAL_STACK_CAP;
+	if (stack->len == stack->cap) {
+		size_t new_cap = MAX(stack->cap * 2, INITIAL_STACK_CAP);
 		assert(new_cap > stack->cap);
-		void **new_buf = xrecallocarray(stack->buf, stack->cap, new_cap, sizeof(void *));
-		stack->buf = new_buf;
+		if (stack->allocator == NULL) {
+			stack->allocator = allocator_current();
+		}
+		if (stack->buf && stack->buf == stack->small) {
+			stack->buf = allocator_recallocarray(stack->allocator, NULL, 0, new_cap, sizeof(void *));
+			memcpy(stack->buf, stack->small, stack->len * sizeof(void *));
+		} else {
+			stack->buf = allocator_recallocarray(stack->allocator, stack->buf, stack->cap, new_cap, sizeof(void *));
+		}
 		stack->cap = new_cap;
 	}
+	stack->buf[stack->len++] = (void *)value;
 }
 
 void
@@ -134,35 +156,21 @@ stack_truncate(struct Stack *stack)
 	stack->len = 0;
 }
 
-struct StackIterator *
+struct StackIterator
 stack_iterator(struct Stack *stack)
 {
-	struct StackIterator *iter = xmalloc(sizeof(struct StackIterator));
-	iter->i = 0;
-	iter->stack = stack;
+	struct StackIterator iter = { .stack = stack, .i = 0 };
 	return iter;
 }
 
-void
-stack_iterator_free(struct StackIterator **iter_)
-{
-	struct StackIterator *iter = *iter_;
-	if (iter != NULL) {
-		free(iter);
-		*iter_ = NULL;
-	}
-}
-
 void *
-stack_iterator_next(struct StackIterator **iter_, size_t *index)
+stack_iterator_next(struct StackIterator *iter, size_t *index)
 {
-	struct StackIterator *iter = *iter_;
 	if (iter->i < iter->stack->len) {
 		*index = iter->i;
 		return iter->stack->buf[iter->stack->len - iter->i++ - 1];
 	} else {
-		stack_iterator_free(iter_);
-		*iter_ = NULL;
+		iter->stack = NULL;
 		return NULL;
 	}
 }
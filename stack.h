@@ -27,11 +27,29 @@
  */
 #pragma once
 
-struct Stack;
-struct StackIterator;
+#define STACK_INLINE_CAP 8
+
+struct Allocator;
+
+struct Stack {
+	void **buf;
+	size_t cap;
+	size_t len;
+	const struct Allocator *allocator;
+	void **small;
+	size_t small_cap;
+};
+
+// SCOPE_STACK keeps the first STACK_INLINE_CAP elements on the C stack
+#define STACK_INITIALIZER(storage) { .buf = (storage), .cap = sizeof(storage) / sizeof(void *), .small = (storage), .small_cap = sizeof(storage) / sizeof(void *) }
+#define SCOPE_STACK(x) \
+	void *x##_storage[STACK_INLINE_CAP]; \
+	struct Stack x __cleanup(stack_finish) = STACK_INITIALIZER(x##_storage)
 
 struct Stack *stack_new(void);
 void stack_free(struct Stack *);
+void stack_init(struct Stack *);
+void stack_finish(struct Stack *);
 size_t stack_len(struct Stack *);
 int stack_contains(struct Stack *, const void *);
 void *stack_peek(struct Stack *);
@@ -39,11 +57,15 @@ void *stack_pop(struct Stack *);
 void stack_push(struct Stack *, const void *);
 void stack_truncate(struct Stack *);
 
-struct StackIterator *stack_iterator(struct Stack *);
-void stack_iterator_free(struct StackIterator **);
-void *stack_iterator_next(struct StackIterator **, size_t *);
+struct StackIterator {
+	struct Stack *stack;
+	size_t i;
+};
+
+struct StackIterator stack_iterator(struct Stack *);
+void *stack_iterator_next(struct StackIterator *, size_t *);
 
 #define STACK_FOREACH(STACK, TYPE, VAR) \
-	for (struct StackIterator *__##VAR##_iter __cleanup(stack_iterator_free) = stack_iterator(STACK); __##VAR##_iter != NULL; stack_iterator_free(&__##VAR##_iter)) \
-	for (size_t VAR##_index = 0; __##VAR##_iter != NULL; stack_iterator_free(&__##VAR##_iter)) \
-	for (TYPE VAR = stack_iterator_next(&__##VAR##_iter, &VAR##_index); __##VAR##_iter != NULL; VAR = stack_iterator_next(&__##VAR##_iter, &VAR##_index))
+	for (struct StackIterator __##VAR##_iter = stack_iterator(STACK); __##VAR##_iter.stack != NULL; __##VAR##_iter.stack = NULL) \
+	for (size_t VAR##_index = 0; __##VAR##_iter.stack != NULL; __##VAR##_iter.stack = NULL) \
+	for (TYPE VAR = stack_iterator_next(&__##VAR##_iter, &VAR##_index); __##VAR##_iter.stack != NULL; VAR = stack_iterator_next(&__##VAR##_iter, &VAR##_index))
@@ -28,12 +28,16 @@
 
 #include "config.h"
 
+// The callsite wrappers must not rename our own definitions
+#undef MEMPOOL_CALLSITES
+
 #include <sys/param.h>
 #if HAVE_ERR
 # include <err.h>
 #endif
 #include <ctype.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -43,9 +47,8 @@
 #include "str.h"
 #include "util.h"
 
+static char *str_vprintf_at(struct Mempool *, const char *, const char *, va_list);
 static size_t xstrlcat(char *, const char *, size_t);
-static char *xstrdup(const char *);
-static char *xstrndup(const char *, size_t);
 
 int
 str_casecompare(const void *ap, const void *bp, void *userdata)
@@ -65,13 +68,19 @@ str_compare(const void *ap, const void *bp, void *userdata)
 
 char *
 str_common_prefix(struct Mempool *pool, const char *a, const char *b)
+{
+	return str_common_prefix_at(pool, NULL, a, b);
+}
+
+char *
+str_common_prefix_at(struct Mempool *pool, const char *callsite, const char *a, const char *b)
 {
 	const char *ap = a;
 	const char *bp = b;
 	size_t i;
 	for (i = 0; *ap != 0 && *bp != 0 && *ap++ == *bp++; i++);
 	if (i > 0) {
-		return mempool_take(pool, xstrndup(a, i));
+		return str_ndup_at(pool, callsite, a, i);
 	} else {
 		return NULL;
 	}
@@ -80,13 +89,33 @@ str_common_prefix(struct Mempool *pool, const char *a, const char *b)
 char *
 str_dup(struct Mempool *pool, const char *s)
 {
-	return mempool_take(pool, xstrdup(s));
+	return str_dup_at(pool, NULL, s);
+}
+
+char *
+str_dup_at(struct Mempool *pool, const char *callsite, const char *s)
+{
+	size_t len = strlen(s);
+	char *buf = mempool_alloc_uninit_at(pool, callsite, len + 1);
+	memcpy(buf, s, len);
+	buf[len] = 0;
+	return buf;
 }
 
 char *
 str_ndup(struct Mempool *pool, const char *s, size_t n)
 {
-	return mempool_take(pool, xstrndup(s, n));
+	return str_ndup_at(pool, NULL, s, n);
+}
+
+char *
+str_ndup_at(struct Mempool *pool, const char *callsite, const char *s, size_t n)
+{
+	size_t len = strnlen(s, n);
+	char *buf = mempool_alloc_uninit_at(pool, callsite, len + 1);
+	memcpy(buf, s, len);
+	buf[len] = 0;
+	return buf;
 }
 
 int
@@ -99,8 +128,27 @@ str_endswith(const char *s, const char *end)
 	return strncmp(s + strlen(s) - len, end, len) == 0;
 }
 
+uint64_t
+str_hash(const void *ap, void *userdata)
+{
+	// FNV-1a
+	const unsigned char *s = *(const unsigned char **)ap;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (; *s; s++) {
+		h ^= *s;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
 char *
 str_join(struct Mempool *pool, struct Array *array, const char *sep)
+{
+	return str_join_at(pool, NULL, array, sep);
+}
+
+char *
+str_join_at(struct Mempool *pool, const char *callsite, struct Array *array, const char *sep)
 {
 	size_t seplen = strlen(sep);
 	size_t lastindex = array_len(array) - 1;
@@ -114,7 +162,8 @@ str_join(struct Mempool *pool, struct Array *array, const char *sep)
 		}
 	}
 
-	char *buf = mempool_alloc(pool, sz);
+	char *buf = mempool_alloc_uninit_at(pool, callsite, sz);
+	buf[0] = 0;
 	i = 0;
 	ARRAY_FOREACH(array, const char *, s) {
 		xstrlcat(buf, s, sz);
@@ -128,7 +177,14 @@ str_join(struct Mempool *pool, struct Array *array, const char *sep)
 char *
 str_map(struct Mempool *pool, const char *s, size_t len, int (*f)(int))
 {
-	char *buf = mempool_alloc(pool, len + 1);
+	return str_map_at(pool, NULL, s, len, f);
+}
+
+char *
+str_map_at(struct Mempool *pool, const char *callsite, const char *s, size_t len, int (*f)(int))
+{
+	// Stops early at a 0 in s and relies on the zeroed rest
+	char *buf = mempool_alloc_at(pool, callsite, len + 1);
 	for (size_t i = 0; i < len && s[i] != 0; i++) {
 		buf[i] = f(s[i]);
 	}
@@ -140,24 +196,51 @@ str_printf(struct Mempool *pool, const char *format, ...)
 {
 	va_list ap;
 	va_start(ap, format);
-	char *buf = NULL;
-	int retval = vasprintf(&buf, format, ap);
-	mempool_take(pool, buf);
+	char *buf = str_vprintf_at(pool, NULL, format, ap);
 	va_end(ap);
+	return buf;
+}
 
-	if (retval < 0) {
-		warn("vasprintf");
+char *
+str_printf_at(struct Mempool *pool, const char *callsite, const char *format, ...)
+{
+	va_list ap;
+	va_start(ap, format);
+	char *buf = str_vprintf_at(pool, callsite, format, ap);
+	va_end(ap);
+	return buf;
+}
+
+char *
+str_vprintf_at(struct Mempool *pool, const char *callsite, const char *format, va_list ap)
+{
+	va_list ap2;
+	va_copy(ap2, ap);
+	int len = vsnprintf(NULL, 0, format, ap);
+	if (len < 0) {
+		warn("vsnprintf");
 		abort();
 	}
 
+	char *buf = mempool_alloc_uninit_at(pool, callsite, len + 1);
+	vsnprintf(buf, len + 1, format, ap2);
+	va_end(ap2);
+
 	return buf;
 }
 
 char *
 str_repeat(struct Mempool *pool, const char *s, const size_t n)
+{
+	return str_repeat_at(pool, NULL, s, n);
+}
+
+char *
+str_repeat_at(struct Mempool *pool, const char *callsite, const char *s, const size_t n)
 {
 	const size_t sz = strlen(s) * n + 1;
-	char *buf = mempool_alloc(pool, sz);
+	char *buf = mempool_alloc_uninit_at(pool, callsite, sz);
+	buf[0] = 0;
 	if (n > 0) {
 		for (size_t i = 0; i < n; i++) {
 			xstrlcat(buf, s, sz);
@@ -168,12 +251,18 @@ str_repeat(struct Mempool *pool, const char *s, const size_t n)
 
 char *
 str_slice(struct Mempool *pool, const char *s, const ssize_t a, const ssize_t b)
+{
+	return str_slice_at(pool, NULL, s, a, b);
+}
+
+char *
+str_slice_at(struct Mempool *pool, const char *callsite, const char *s, const ssize_t a, const ssize_t b)
 {
 	size_t len = strlen(s);
 	size_t start = 0;
 	size_t end = 0;
 	slice_to_range(len, a, b, &start, &end);
-	return str_ndup(pool, s + start, end - start);
+	return str_ndup_at(pool, callsite, s + start, end - start);
 }
 
 int
@@ -188,50 +277,46 @@ str_startswith(const char *s, const char *start)
 
 char *
 str_trim(struct Mempool *pool, const char *s)
+{
+	return str_trim_at(pool, NULL, s);
+}
+
+char *
+str_trim_at(struct Mempool *pool, const char *callsite, const char *s)
 {
 	const char *sp = s;
 	for (; *sp && isspace(*sp); ++sp);
-	return str_trimr(pool, sp);
+	return str_trimr_at(pool, callsite, sp);
 }
 
 char *
 str_triml(struct Mempool *pool, const char *s)
 {
-	const char *sp = s;
-	for (; *sp && isspace(*sp); ++sp);
-	return mempool_take(pool, xstrdup(sp));
+	return str_triml_at(pool, NULL, s);
 }
 
 char *
-str_trimr(struct Mempool *pool, const char *s)
+str_triml_at(struct Mempool *pool, const char *callsite, const char *s)
 {
-	size_t len = strlen(s);
-	while (len > 0 && isspace(s[len - 1])) {
-		len--;
-	}
-	return mempool_take(pool, xstrndup(s, len));
+	const char *sp = s;
+	for (; *sp && isspace(*sp); ++sp);
+	return str_dup_at(pool, callsite, sp);
 }
 
 char *
-xstrdup(const char *s)
+str_trimr(struct Mempool *pool, const char *s)
 {
-	char *retval = strdup(s);
-	if (retval == NULL) {
-		warn("strdup");
-		abort();
-	}
-	return retval;
+	return str_trimr_at(pool, NULL, s);
 }
 
 char *
-xstrndup(const char *s, size_t len)
+str_trimr_at(struct Mempool *pool, const char *callsite, const char *s)
 {
-	char *retval = strndup(s, len);
-	if (retval == NULL) {
-		warn("strndup");
-		abort();
+	size_t len = strlen(s);
+	while (len > 0 && isspace(s[len - 1])) {
+		len--;
 	}
-	return retval;
+	return str_ndup_at(pool, callsite, s, len);
 }
 
 size_t
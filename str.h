@@ -36,6 +36,7 @@ int str_compare(const void *, const void *, void *);
 char *str_dup(struct Mempool *, const char *);
 char *str_ndup(struct Mempool *, const char *, size_t);
 int str_endswith(const char *, const char *);
+uint64_t str_hash(const void *, void *);
 char *str_join(struct Mempool *, struct Array *, const char *);
 char *str_map(struct Mempool *, const char *, size_t, int (*)(int));
 char *str_printf(struct Mempool *, const char *, ...) __printflike(2, 3);
@@ -45,3 +46,29 @@ int str_startswith(const char *, const char *);
 char *str_trim(struct Mempool *, const char *);
 char *str_triml(struct Mempool *, const char *);
 char *str_trimr(struct Mempool *, const char *);
+
+char *str_common_prefix_at(struct Mempool *, const char *, const char *, const char *);
+char *str_dup_at(struct Mempool *, const char *, const char *);
+char *str_ndup_at(struct Mempool *, const char *, const char *, size_t);
+char *str_join_at(struct Mempool *, const char *, struct Array *, const char *);
+char *str_map_at(struct Mempool *, const char *, const char *, size_t, int (*)(int));
+char *str_printf_at(struct Mempool *, const char *, const char *, ...) __printflike(3, 4);
+char *str_repeat_at(struct Mempool *, const char *, const char *, const size_t);
+char *str_slice_at(struct Mempool *, const char *, const char *, const ssize_t, const ssize_t);
+char *str_trim_at(struct Mempool *, const char *, const char *);
+char *str_triml_at(struct Mempool *, const char *, const char *);
+char *str_trimr_at(struct Mempool *, const char *, const char *);
+
+#if defined(MEMPOOL_CALLSITES)
+#define str_common_prefix(pool, ...) str_common_prefix_at(pool, MEMPOOL_CALLSITE, __VA_ARGS__)
+#define str_dup(pool, ...) str_dup_at(pool, MEMPOOL_CALLSITE, __VA_ARGS__)
+#define str_ndup(pool, ...) str_ndup_at(pool, MEMPOOL_CALLSITE, __VA_ARGS__)
+#define str_join(pool, ...) str_join_at(pool, MEMPOOL_CALLSITE, __VA_ARGS__)
+#define str_map(pool, ...) str_map_at(pool, MEMPOOL_CALLSITE, __VA_ARGS__)
+#define str_printf(pool, ...) str_printf_at(pool, MEMPOOL_CALLSITE, __VA_ARGS__)
+#define str_repeat(pool, ...) str_repeat_at(pool, MEMPOOL_CALLSITE, __VA_ARGS__)
+#define str_slice(pool, ...) str_slice_at(pool, MEMPOOL_CALLSITE, __VA_ARGS__)
+#define str_trim(pool, ...) str_trim_at(pool, MEMPOOL_CALLSITE, __VA_ARGS__)
+#define str_triml(pool, ...) str_triml_at(pool, MEMPOOL_CALLSITE, __VA_ARGS__)
+#define str_trimr(pool, ...) str_trimr_at(pool, MEMPOOL_CALLSITE, __VA_ARGS__)
+#endif
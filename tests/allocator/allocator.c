@@ -0,0 +1,190 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2020 Tobias Kortkamp <tobik@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "array.h"
+#include "heap.h"
+#include "map.h"
+#include "mempool.h"
+#include "objpool.h"
+#include "queue.h"
+#include "set.h"
+#include "stack.h"
+#include "str.h"
+#include "test.h"
+
+struct Counter {
+	size_t live;
+	size_t allocs;
+	size_t dirty;
+};
+
+static void *
+counting_alloc(void *ctx, size_t size)
+{
+	struct Counter *counter = ctx;
+	counter->live++;
+	counter->allocs++;
+	return malloc(size);
+}
+
+static void *
+counting_realloc(void *ctx, void *ptr, size_t old, size_t size)
+{
+	struct Counter *counter = ctx;
+	for (size_t i = size; i < old; i++) {
+		if (((char *)ptr)[i] != 0) {
+			counter->dirty++;
+		}
+	}
+	return realloc(ptr, size);
+}
+
+static void
+counting_free(void *ctx, void *ptr)
+{
+	struct Counter *counter = ctx;
+	counter->live--;
+	free(ptr);
+}
+
+static int
+compare_int(const void *ap, const void *bp, void *userdata)
+{
+	const void *a = *(const void **)ap;
+	const void *b = *(const void **)bp;
+	return (intptr_t)a - (intptr_t)b;
+}
+
+TESTS() {
+	struct Counter counter = { 0 };
+	struct Allocator allocator = {
+		.alloc = counting_alloc,
+		.realloc = counting_realloc,
+		.free = counting_free,
+		.ctx = &counter,
+	};
+
+	TEST(allocator_current() == &allocator_malloc);
+	TEST(allocator_use(&allocator) == NULL);
+	TEST(allocator_current() == &allocator);
+
+	struct Array *array = array_new();
+	for (size_t i = 0; i < 100; i++) {
+		array_append(array, "1");
+	}
+	struct Map *map = map_new_hash(str_hash, str_compare, NULL, NULL, NULL);
+	struct Map *btree = map_new_btree(str_compare, NULL, NULL, NULL);
+	struct Map *tree = map_new(str_compare, NULL, NULL, NULL);
+	struct Set *set = set_new(str_compare, NULL, NULL);
+	struct Stack *stack = stack_new();
+	struct Queue *queue = queue_new();
+	struct Heap *heap = heap_new(compare_int, NULL);
+	struct Mempool *custom = mempool_new();
+	TEST(allocator_use(NULL) == &allocator);
+	TEST(allocator_current() == &allocator_malloc);
+
+	size_t allocs = counter.allocs;
+	for (size_t i = 0; i < 1000; i++) {
+		char *key = str_printf(pool, "%zu", i);
+		map_add(map, key, key);
+		map_add(btree, key, key);
+		map_add(tree, key, key);
+		set_add(set, key);
+		stack_push(stack, key);
+		queue_push(queue, key);
+		heap_push(heap, (void *)i);
+	}
+	TEST(counter.allocs > allocs);
+	TEST(map_len(tree) == 1000 && set_len(set) == 1000);
+	array_free(array);
+	map_free(map);
+	map_free(btree);
+	map_free(tree);
+	set_free(set);
+	stack_free(stack);
+	queue_free(queue);
+	heap_free(heap);
+
+	mempool_profile(custom);
+	allocs = counter.allocs;
+	char *s = str_dup(custom, "foo");
+	TEST(counter.allocs > allocs);
+	str_dup(custom, "bar");
+	mempool_release(custom, s);
+	struct Array *parray = mempool_array(custom);
+	for (size_t i = 0; i < 100; i++) {
+		array_append(parray, "1");
+	}
+	struct Objpool *objpool = mempool_objpool(custom, 8);
+	objpool_alloc(objpool);
+	char *moved = mempool_move(custom, str_dup(custom, "baz"), pool);
+	TEST(counter.live > 0);
+	mempool_free(custom);
+	TEST(counter.live == 1);
+	mempool_release(pool, moved);
+	TEST(counter.live == 0);
+
+	// The default applies to all threads without an override
+	allocator_set_default(&allocator);
+	TEST(allocator_current() == &allocator);
+	struct Mempool *arena = mempool_new_arena();
+	str_dup(arena, "foo");
+	allocator_set_default(NULL);
+	TEST(allocator_current() == &allocator_malloc);
+	TEST(counter.live > 0);
+	mempool_free(arena);
+	TEST(counter.live == 0);
+
+	// Shrinking clears the tail before it is handed to realloc
+	char *buf = allocator_recallocarray(&allocator, NULL, 0, 8, 1);
+	memcpy(buf, "foobar", 7);
+	buf = allocator_recallocarray(&allocator, buf, 8, 4, 1);
+	TEST(counter.dirty == 0);
+	TEST(memcmp(buf, "foob", 4) == 0);
+	buf = allocator_recallocarray(&allocator, buf, 4, 8, 1);
+	TEST(memcmp(buf, "foob\0\0\0\0", 8) == 0);
+	allocator_free(&allocator, buf);
+
+	// Without realloc the allocator is emulated with alloc and free
+	allocator.realloc = NULL;
+	buf = allocator_recallocarray(&allocator, NULL, 0, 4, 1);
+	memcpy(buf, "foo", 4);
+	buf = allocator_recallocarray(&allocator, buf, 4, 8, 1);
+	TEST_STREQ(buf, "foo");
+	TEST(memcmp(buf + 4, "\0\0\0\0", 4) == 0);
+	allocator_free(&allocator, buf);
+	TEST(counter.live == 0);
+}
@@ -38,6 +38,19 @@
 #include "test.h"
 #include "util.h"
 
+struct Point {
+	int x;
+	int y;
+};
+
+static int
+compare_point(const void *ap, const void *bp, void *userdata)
+{
+	const struct Point *a = ap;
+	const struct Point *b = bp;
+	return a->x - b->x;
+}
+
 TESTS() {
 	struct Array *array = mempool_array(pool);
 	array_append(array, "1");
@@ -134,4 +147,80 @@ TESTS() {
 		i++;
 	}
 	TEST(i == 2);
+
+	array = mempool_array(pool);
+	array_reserve(array, 100);
+	TEST(array_capacity(array) == 100);
+	for (size_t i = 0; i < 100; i++) {
+		array_append(array, "1");
+	}
+	TEST(array_capacity(array) == 100);
+	array_append(array, "2");
+	TEST(array_len(array) == 101);
+	TEST(array_capacity(array) > 101);
+	TEST_STREQ(array_get(array, 100), "2");
+	array_truncate_at(array, 3);
+	array_shrink_to_fit(array);
+	TEST(array_capacity(array) == 3);
+	TEST_STREQ(array_get(array, 2), "1");
+	array_append(array, "3");
+	TEST_STREQ(array_get(array, 3), "3");
+
+	array = mempool_array_sized(pool, sizeof(struct Point));
+	for (int i = 0; i < 20; i++) {
+		struct Point p = { .x = 20 - i, .y = i };
+		array_append(array, &p);
+	}
+	TEST(array_len(array) == 20);
+	struct Point *p = array_append_value(array, NULL);
+	TEST(p->x == 0 && p->y == 0);
+	p->x = 21;
+	TEST(((struct Point *)array_get(array, 20))->x == 21);
+	array_set(array, 20, NULL);
+	TEST(p->x == 0 && p->y == 0);
+	array_set(array, 20, &(struct Point){ .x = 21 });
+	TEST(array_get_ptr(array, 21) == NULL);
+	struct Point key = { .x = 15, .y = 5 };
+	TEST(array_find(array, &key, NULL, NULL) == 5);
+	array_sort(array, compare_point, NULL);
+	i = 0;
+	ARRAY_FOREACH(array, struct Point *, p) {
+		TEST_IF(i == p_index) {
+			TEST(p->x == (int)i + 1);
+		}
+		i++;
+	}
+	TEST(i == 21);
+	TEST(((struct Point *)array_pop(array))->x == 21);
+	TEST(array_len(array) == 20);
+
+	// Only SCOPE_ARRAY arrays have inline storage
+	TEST(sizeof(struct Array) <= 8 * sizeof(void *));
+	struct Array *empty = mempool_array(pool);
+	TEST(array_capacity(empty) == 0);
+
+	SCOPE_ARRAY(local);
+	array_append(&local, "1");
+	TEST(array_capacity(&local) == ARRAY_INLINE_CAP);
+	for (size_t i = 0; i < 20; i++) {
+		array_append(&local, "2");
+	}
+	TEST(array_len(&local) == 21);
+	TEST(array_capacity(&local) > ARRAY_INLINE_CAP);
+	TEST_STREQ(array_get(&local, 0), "1");
+	TEST_STREQ(array_get(&local, 20), "2");
+	array_finish(&local);
+	TEST(array_capacity(&local) == ARRAY_INLINE_CAP);
+	array_append(&local, "3");
+	TEST_STREQ(array_get(&local, 0), "3");
+
+	struct Array points;
+	array_init_sized(&points, sizeof(struct Point));
+	for (int i = 0; i < 10; i++) {
+		struct Point p = { .x = i, .y = -i };
+		array_append(&points, &p);
+	}
+	TEST(((struct Point *)array_get(&points, 9))->y == -9);
+	array_finish(&points);
+	TEST(array_len(&points) == 0);
 }
@@ -0,0 +1,151 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2020 Tobias Kortkamp <tobik@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "array.h"
+#include "btree.h"
+#include "mempool.h"
+#include "str.h"
+#include "test.h"
+
+// Returns 0 if a node other than the root is underfull, leaves sit at
+// different depths, or a separator is not the smallest key of the
+// subtree to its right.  Counts the nodes and sets *min to the smallest
+// key of the subtree.
+static int
+btree_check(struct BTreeNode *node, int root, size_t depth, size_t *leafdepth, size_t *nodes, void **min)
+{
+	(*nodes)++;
+	if (!root && node->len < BTREE_MIN) {
+		return 0;
+	}
+	if (node->leaf) {
+		if (*leafdepth == 0) {
+			*leafdepth = depth;
+		}
+		*min = node->keys[0];
+		return *leafdepth == depth;
+	}
+	for (size_t i = 0; i <= node->len; i++) {
+		void *childmin;
+		if (!btree_check(node->children[i], 0, depth + 1, leafdepth, nodes, &childmin)) {
+			return 0;
+		} else if (i == 0) {
+			*min = childmin;
+		} else if (node->keys[i - 1] != childmin) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+TESTS() {
+	// Trees with and without values, filled by inserts or in bulk.
+	// The keys 1..N are stored as pointers and compared as such.
+	const uintptr_t N = 10000;
+	for (int mode = 0; mode < 4; mode++) {
+		int values = mode & 1;
+		struct BTree tree;
+		btree_init(&tree, NULL, NULL, allocator_current(), values);
+		if (mode & 2) {
+			struct Array *keys = mempool_array(pool);
+			for (uintptr_t i = 1; i <= N; i++) {
+				array_append(keys, (void *)i);
+			}
+			TEST(btree_build(&tree, keys, values ? keys : NULL, NULL, NULL));
+		} else {
+			for (uintptr_t i = 1; i <= N; i++) {
+				size_t index;
+				int inserted;
+				struct BTreeNode *node = btree_insert(&tree, (void *)i, &index, &inserted);
+				if (values) {
+					node->values[index] = (void *)i;
+				}
+			}
+		}
+		TEST(tree.len == N);
+		size_t depth = 0;
+		size_t nodes = 0;
+		void *min;
+		TEST(btree_check(tree.root, 1, 1, &depth, &nodes, &min));
+		TEST(depth >= 3);
+
+		// Remove all but every 1000th key in an order that takes
+		// keys from all over the tree.  Nodes are borrowed from,
+		// merged, and the root collapses as the tree shrinks.
+		int ok = 1;
+		for (uintptr_t k = 0; k < N; k++) {
+			uintptr_t i = (k * 7919) % N + 1;
+			if (i % 1000 == 0) {
+				continue;
+			}
+			void *oldkey;
+			void *oldvalue;
+			ok = ok && btree_remove(&tree, (void *)i, &oldkey, &oldvalue);
+			ok = ok && oldkey == (void *)i && oldvalue == (values ? (void *)i : NULL);
+			if (k % 500 == 0) {
+				depth = 0;
+				nodes = 0;
+				ok = ok && btree_check(tree.root, 1, 1, &depth, &nodes, &min);
+			}
+		}
+		TEST(ok);
+		TEST(tree.len == N / 1000);
+		depth = 0;
+		nodes = 0;
+		TEST(btree_check(tree.root, 1, 1, &depth, &nodes, &min));
+		TEST(depth == 1);
+		TEST(nodes == 1);
+
+		uintptr_t expected = 1000;
+		for (struct BTreeNode *node = btree_first(&tree); node; node = node->next) {
+			for (size_t i = 0; i < node->len; i++) {
+				TEST(node->keys[i] == (void *)expected);
+				expected += 1000;
+			}
+		}
+		TEST(expected == N + 1000);
+
+		void *oldkey;
+		void *oldvalue;
+		TEST(!btree_remove(&tree, (void *)1, &oldkey, &oldvalue));
+		for (uintptr_t i = 1000; i <= N; i += 1000) {
+			TEST(btree_remove(&tree, (void *)i, &oldkey, &oldvalue));
+		}
+		TEST(tree.root == NULL);
+		TEST(tree.len == 0);
+		btree_truncate(&tree, NULL, NULL);
+	}
+}
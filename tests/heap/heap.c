@@ -0,0 +1,117 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2021 Tobias Kortkamp <tobik@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "array.h"
+#include "heap.h"
+#include "mempool.h"
+#include "str.h"
+#include "test.h"
+#include "util.h"
+
+struct Task {
+	int priority;
+	const char *name;
+};
+
+static int
+compare_task(const void *ap, const void *bp, void *userdata)
+{
+	const struct Task *a = *(const struct Task **)ap;
+	const struct Task *b = *(const struct Task **)bp;
+	return a->priority - b->priority;
+}
+
+TESTS() {
+	struct Heap *heap = mempool_heap(pool, str_compare, NULL);
+	TEST(heap_peek(heap) == NULL);
+	TEST(heap_pop(heap) == NULL);
+	const char *words[] = { "m", "c", "x", "a", "q", "c", "b", "z", "k" };
+	for (size_t i = 0; i < nitems(words); i++) {
+		heap_push(heap, words[i]);
+	}
+	TEST(heap_len(heap) == nitems(words));
+	TEST_STREQ(heap_peek(heap), "a");
+	struct Array *sorted = mempool_array(pool);
+	char *word;
+	while ((word = heap_pop(heap))) {
+		array_append(sorted, word);
+	}
+	TEST_STREQ(str_join(pool, sorted, ""), "abcckmqxz");
+	TEST(heap_len(heap) == 0);
+
+	struct Task tasks[] = {
+		{ 5, "e" }, { 3, "c" }, { 9, "i" }, { 1, "a" }, { 7, "g" },
+	};
+	heap = mempool_heap(pool, compare_task, NULL);
+	size_t handles[nitems(tasks)];
+	for (size_t i = 0; i < nitems(tasks); i++) {
+		handles[i] = heap_push(heap, &tasks[i]);
+	}
+	TEST(heap_get(heap, handles[2]) == &tasks[2]);
+	tasks[2].priority = 0;
+	heap_update(heap, handles[2]);
+	TEST_STREQ(((struct Task *)heap_peek(heap))->name, "i");
+	tasks[2].priority = 10;
+	heap_update(heap, handles[2]);
+	TEST_STREQ(((struct Task *)heap_peek(heap))->name, "a");
+	TEST(heap_remove(heap, handles[1]) == &tasks[1]);
+	TEST(heap_len(heap) == 4);
+	size_t handle = heap_push(heap, &tasks[1]);
+	TEST(handle == handles[1]);
+	TEST_STREQ(((struct Task *)heap_pop(heap))->name, "a");
+	TEST_STREQ(((struct Task *)heap_pop(heap))->name, "c");
+	TEST_STREQ(((struct Task *)heap_pop(heap))->name, "e");
+	TEST_STREQ(((struct Task *)heap_pop(heap))->name, "g");
+	TEST_STREQ(((struct Task *)heap_pop(heap))->name, "i");
+	TEST(heap_len(heap) == 0);
+
+	struct Array *numbers = mempool_array(pool);
+	for (uintptr_t i = 0; i < 1000; i++) {
+		array_append(numbers, str_printf(pool, "%04lu", (unsigned long)((i * 7919) % 1000)));
+	}
+	heap = mempool_add(pool, heap_from_array(numbers, str_compare, NULL), heap_free);
+	TEST(heap_len(heap) == 1000);
+	size_t n = 0;
+	char *last = NULL;
+	while ((word = heap_pop(heap))) {
+		if (last && strcmp(last, word) > 0) {
+			break;
+		}
+		last = word;
+		n++;
+	}
+	TEST(n == 1000);
+	TEST_STREQ(last, "0999");
+}
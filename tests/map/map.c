@@ -28,12 +28,17 @@
 
 #include "config.h"
 
+#include <sys/wait.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "array.h"
 #include "map.h"
 #include "mempool.h"
+#include "set.h"
 #include "test.h"
 #include "str.h"
 #include "util.h"
@@ -74,4 +79,234 @@ TESTS() {
 		i++;
 	}
 	TEST(i == 0);
+
+	map = mempool_map_hash(pool, str_hash, str_compare, NULL, NULL, NULL);
+	for (size_t i = 0; i < 1000; i++) {
+		char *key = str_printf(pool, "%zu", i);
+		map_add(map, key, key);
+	}
+	TEST(map_len(map) == 1000);
+	map_add(map, "10", "foo");
+	TEST(map_len(map) == 1000);
+	TEST_STREQ(map_get(map, "10"), "10");
+	TEST(map_get(map, "1000") == NULL);
+	for (size_t i = 0; i < 1000; i += 2) {
+		map_remove(map, str_printf(pool, "%zu", i));
+	}
+	TEST(map_len(map) == 500);
+	TEST(!map_contains(map, "10"));
+	TEST_STREQ(map_get(map, "11"), "11");
+	i = 0;
+	MAP_FOREACH(map, char *, key, char *, value) {
+		if (strtol(key, NULL, 10) % 2 == 1 && strcmp(key, value) == 0) {
+			i++;
+		}
+	}
+	TEST(i == 500);
+	map_truncate(map);
+	TEST(map_len(map) == 0);
+	TEST(map_get(map, "11") == NULL);
+	map_add(map, "11", "foo");
+	TEST_STREQ(map_get(map, "11"), "foo");
+
+	map = mempool_map(pool, str_compare, NULL, NULL, NULL);
+	map_add(map, "1", NULL);
+	void *value = map;
+	TEST(map_contains(map, "1"));
+	TEST(map_lookup(map, "1", &value) && value == NULL);
+	TEST(!map_lookup(map, "2", &value));
+	map_put(map, "1", "foo");
+	map_put(map, "2", "bar");
+	TEST(map_len(map) == 2);
+	TEST_STREQ(map_get(map, "1"), "foo");
+	TEST_STREQ(map_get(map, "2"), "bar");
+
+	const char *words[] = { "a", "b", "a", "c", "a", "b" };
+	struct Map *maps[] = {
+		mempool_map(pool, str_compare, NULL, NULL, NULL),
+		mempool_map_hash(pool, str_hash, str_compare, NULL, NULL, NULL),
+		mempool_map_btree(pool, str_compare, NULL, NULL, NULL),
+	};
+	for (size_t i = 0; i < nitems(maps); i++) {
+		for (size_t j = 0; j < nitems(words); j++) {
+			int inserted;
+			size_t *count = (size_t *)map_get_or_insert(maps[i], words[j], &inserted);
+			TEST(inserted == (j < 2 || j == 3));
+			(*count)++;
+		}
+		TEST(map_len(maps[i]) == 3);
+		TEST((size_t)map_get(maps[i], "a") == 3);
+		TEST((size_t)map_get(maps[i], "b") == 2);
+		TEST((size_t)map_get(maps[i], "c") == 1);
+	}
+
+	maps[0] = mempool_map(pool, str_compare, NULL, NULL, NULL);
+	maps[1] = mempool_map_hash(pool, str_hash, str_compare, NULL, NULL, NULL);
+	maps[2] = mempool_map_btree(pool, str_compare, NULL, NULL, NULL);
+	const char *keys[] = { "foo", "foo.a", "foo.b", "foo/a", "fop", "bar" };
+	for (size_t i = 0; i < nitems(maps); i++) {
+		for (size_t j = 0; j < nitems(keys); j++) {
+			map_add(maps[i], keys[j], keys[j]);
+		}
+		TEST_STREQ(map_lower_bound(maps[i], "foo", NULL), "foo");
+		TEST_STREQ(map_upper_bound(maps[i], "foo", NULL), "foo.a");
+		TEST_STREQ(map_lower_bound(maps[i], "foo.c", &value), "foo/a");
+		TEST_STREQ(value, "foo/a");
+		TEST(map_upper_bound(maps[i], "fop", NULL) == NULL);
+		size_t n = 0;
+		MAP_FOREACH_RANGE(maps[i], "foo.", "foo/", char *, key, char *, value) {
+			TEST(str_startswith(key, "foo."));
+			n++;
+		}
+		TEST(n == 2);
+		n = 0;
+		MAP_FOREACH_RANGE(maps[i], "foo/", "foo.", char *, key, char *, value) {
+			n++;
+		}
+		TEST(n == 0);
+	}
+	size_t n = 0;
+	MAP_FOREACH_RANGE(maps[0], "c", NULL, char *, key, char *, value) {
+		switch (n++) {
+		case 0: TEST_STREQ(key, "foo"); break;
+		case 4: TEST_STREQ(key, "fop"); break;
+		}
+	}
+	TEST(n == 5);
+
+	map = mempool_map_btree(pool, str_compare, NULL, NULL, NULL);
+	for (size_t i = 0; i < 1000; i++) {
+		char *key = str_printf(pool, "%04zu", 999 - i);
+		map_add(map, key, key);
+	}
+	TEST(map_len(map) == 1000);
+	for (size_t i = 0; i < 1000; i++) {
+		if (i % 3 != 0) {
+			map_remove(map, str_printf(pool, "%04zu", i));
+		}
+	}
+	TEST(map_len(map) == 334);
+	TEST_STREQ(map_get(map, "0999"), "0999");
+	TEST(!map_contains(map, "0998"));
+	TEST_STREQ(map_upper_bound(map, "0500", NULL), "0501");
+	n = 0;
+	MAP_FOREACH(map, char *, key, char *, value) {
+		TEST_IF(strcmp(key, value) == 0) {
+			TEST((size_t)strtol(key, NULL, 10) == key_index * 3);
+		}
+		n++;
+	}
+	TEST(n == 334);
+	map_truncate(map);
+	TEST(map_len(map) == 0);
+	TEST(map_lower_bound(map, "0", NULL) == NULL);
+	map_add(map, "1", "foo");
+	TEST_STREQ(map_get(map, "1"), "foo");
+
+	struct Array *sorted = mempool_array(pool);
+	for (size_t i = 0; i < 2000; i++) {
+		array_append(sorted, str_printf(pool, "%04zu", i / 2));
+	}
+	map = map_from_sorted_array(sorted, NULL, str_compare, NULL, NULL, NULL);
+	TEST(map_len(map) == 1000);
+	TEST(map_contains(map, "0000"));
+	TEST(map_contains(map, "0999"));
+	TEST(!map_contains(map, "1000"));
+	TEST_STREQ(map_lower_bound(map, "0500.", NULL), "0501");
+	struct Array *sortedkeys = map_keys(map, pool);
+	n = 0;
+	ARRAY_FOREACH(sortedkeys, char *, key) {
+		if (key_index + 1 < array_len(sortedkeys)) {
+			TEST(strcmp(key, array_get(sortedkeys, key_index + 1)) < 0);
+		}
+		n++;
+	}
+	TEST(n == 1000);
+	struct Map *copy = map_from_sorted_array(sortedkeys, sortedkeys, str_compare, NULL, NULL, NULL);
+	map_free(map);
+	map_add(copy, "0500.", "foo");
+	map_remove(copy, "0000");
+	TEST(map_len(copy) == 1000);
+	TEST_STREQ(map_get(copy, "0500"), "0500");
+	TEST_STREQ(map_get(copy, "0500."), "foo");
+	map_free(copy);
+
+	map = mempool_add(pool, map_from_sorted_array(mempool_array(pool), NULL, str_compare, NULL, NULL, NULL), map_free);
+	TEST(map_len(map) == 0);
+	map_add(map, "1", "foo");
+	TEST_STREQ(map_get(map, "1"), "foo");
+
+	// Every size is looked up and removed again, including ones that
+	// leave a single leaf or a single child for the last inner node.
+	size_t sizes[] = { 1, 32, 33, 65, 1056, 1057, 1089, 2000 };
+	for (size_t i = 0; i < nitems(sizes); i++) {
+		struct Array *keys = mempool_array(pool);
+		for (size_t j = 0; j < sizes[i]; j++) {
+			array_append(keys, str_printf(pool, "%05zu", j));
+		}
+		map = map_from_sorted_array(keys, keys, str_compare, NULL, NULL, NULL);
+		TEST(map_len(map) == sizes[i]);
+		ARRAY_FOREACH(keys, char *, key) {
+			TEST_STREQ(map_get(map, key), key);
+		}
+		ARRAY_FOREACH(keys, char *, key) {
+			map_remove(map, key);
+		}
+		TEST(map_len(map) == 0);
+		map_free(map);
+	}
+
+	// Duplicates are freed unless they are the pointer that is kept
+	struct Array *dupkeys = mempool_array(pool);
+	struct Array *dupvalues = mempool_array(pool);
+	char *sharedkey = str_dup(NULL, "c");
+	char *sharedvalue = str_dup(NULL, "5");
+	const char *dups[] = { "a", "a", "b", "b", "b" };
+	for (size_t i = 0; i < nitems(dups); i++) {
+		array_append(dupkeys, str_dup(NULL, dups[i]));
+		array_append(dupvalues, str_printf(NULL, "%zu", i));
+	}
+	for (size_t i = 0; i < 2; i++) {
+		array_append(dupkeys, sharedkey);
+		array_append(dupvalues, sharedvalue);
+	}
+	map = map_from_sorted_array(dupkeys, dupvalues, str_compare, NULL, free, free);
+	TEST(map_len(map) == 3);
+	TEST_STREQ(map_get(map, "a"), "0");
+	TEST_STREQ(map_get(map, "b"), "2");
+	TEST(map_get(map, "c") == sharedvalue);
+	map_free(map);
+
+	// Unsorted keys, missing values, and hash maps that compare keys
+	// but hash pointers abort
+	struct Array *unsorted = mempool_array(pool);
+	array_append(unsorted, "b");
+	array_append(unsorted, "a");
+	for (int i = 0; i < 4; i++) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			freopen("/dev/null", "w", stderr);
+			switch (i) {
+			case 0: map_from_sorted_array(unsorted, NULL, str_compare, NULL, NULL, NULL); break;
+			case 1: map_from_sorted_array(sortedkeys, unsorted, str_compare, NULL, NULL, NULL); break;
+			case 2: set_from_sorted_array(unsorted, str_compare, NULL, NULL); break;
+			case 3: map_new_hash(NULL, str_compare, NULL, NULL, NULL); break;
+			}
+			_exit(0);
+		}
+		int status;
+		TEST(waitpid(pid, &status, 0) == pid && WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+	}
+
+	struct Set *set = mempool_add(pool, set_from_sorted_array(sortedkeys, str_compare, NULL, NULL), set_free);
+	TEST(set_len(set) == 1000);
+	TEST(set_contains(set, "0042"));
+	n = 0;
+	SET_FOREACH(set, char *, key) {
+		TEST_IF(n == key_index) {
+			TEST_STREQ(key, array_get(sortedkeys, key_index));
+		}
+		n++;
+	}
+	TEST(n == 1000);
 }
@@ -0,0 +1,361 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2021 Tobias Kortkamp <tobik@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#define MEMPOOL_CALLSITES
+
+#include <sys/wait.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "io.h"
+#include "mempool.h"
+#include "mempool/file.h"
+#include "str.h"
+#include "test.h"
+#include "util.h"
+
+#define THREADS 4
+#define OBJECTS 10000
+
+static size_t freed;
+
+static void
+count_free(void *ptr)
+{
+	__atomic_add_fetch(&freed, 1, __ATOMIC_RELAXED);
+}
+
+static void *
+worker(void *userdata)
+{
+	struct Mempool *pool = userdata;
+	for (size_t i = 0; i < OBJECTS; i++) {
+		char *s = str_printf(pool, "%zu", i);
+		if (strtol(s, NULL, 10) != (long)i) {
+			abort();
+		}
+		mempool_add(pool, s, count_free);
+		free(mempool_release(pool, str_dup(NULL, s)));
+		mempool_release(pool, mempool_take(pool, str_dup(NULL, s)));
+	}
+	return NULL;
+}
+
+TESTS() {
+	struct Mempool *arena = mempool_new_arena();
+	char *a = mempool_alloc(arena, 3);
+	char *b = mempool_alloc(arena, 5);
+	TEST((uintptr_t)a % 16 == 0);
+	TEST((uintptr_t)b % 16 == 0);
+	TEST(a != b);
+	TEST(a[0] == 0 && b[4] == 0);
+	char *large = mempool_alloc(arena, 100000);
+	TEST(large[99999] == 0);
+	memset(large, 'x', 100000);
+	char *c = mempool_alloc(arena, 16);
+	TEST(c[0] == 0);
+	size_t ok = 0;
+	for (size_t i = 0; i < 10000; i++) {
+		char *s = str_printf(arena, "%zu", i);
+		if (strtol(s, NULL, 10) == (long)i) {
+			ok++;
+		}
+	}
+	TEST(ok == 10000);
+	TEST_STREQ(str_dup(arena, "foo"), "foo");
+	TEST_STREQ(str_ndup(arena, "foobar", 3), "foo");
+	TEST_STREQ(str_trim(arena, "  foo  "), "foo");
+
+	mempool_add(arena, a, count_free);
+	mempool_add(arena, b, count_free);
+	mempool_release_all(arena);
+	TEST(freed == 2);
+	a = mempool_alloc(arena, 8);
+	TEST(a[0] == 0);
+
+	struct Mempool *child = mempool_new_arena();
+	char *s = str_dup(child, "child");
+	mempool_inherit(pool, child);
+	mempool_free(child);
+	TEST_STREQ(s, "child");
+	mempool_free(arena);
+
+	struct Mempool *a1 = mempool_new();
+	struct Mempool *a2 = mempool_new_unique();
+	char *ptrs[1000];
+	for (size_t i = 0; i < nitems(ptrs); i++) {
+		ptrs[i] = str_printf(a1, "%zu", i);
+	}
+	for (size_t i = 0; i < nitems(ptrs); i += 2) {
+		mempool_release(a1, ptrs[i]);
+	}
+	for (size_t i = 1; i < nitems(ptrs); i += 4) {
+		mempool_move(a1, ptrs[i], a2);
+		mempool_move(a1, ptrs[i], a2);
+	}
+	TEST(mempool_forget(a1, ptrs[3]) == ptrs[3]);
+	mempool_free(a1);
+	TEST_STREQ(ptrs[1], "1");
+	TEST_STREQ(ptrs[997], "997");
+	free(ptrs[3]);
+	mempool_add(a2, ptrs[5], count_free);
+	mempool_add(a2, ptrs[5], count_free);
+	freed = 0;
+	mempool_free(a2);
+	TEST(freed == 0);
+
+	// Every registration of a pointer is indexed
+	struct Mempool *dups = mempool_new();
+	char *dup = mempool_alloc(pool, 1);
+	mempool_add(dups, dup, count_free);
+	mempool_add(dups, dup, count_free);
+	mempool_add(dups, dup, count_free);
+	TEST(mempool_forget(dups, dup) == dup);
+	mempool_add(dups, dup, count_free);
+	TEST(mempool_forget(dups, dup) == dup);
+	mempool_release(dups, dup);
+	TEST(freed == 1);
+	freed = 0;
+	mempool_free(dups);
+	TEST(freed == 1);
+
+	struct Mempool *pools[] = { mempool_new(), mempool_new_arena() };
+	for (size_t i = 0; i < nitems(pools); i++) {
+		char *keep = str_dup(pools[i], "keep");
+		mempool_add(pools[i], keep, count_free);
+		struct MempoolMark mark = mempool_mark(pools[i]);
+		freed = 0;
+		for (size_t j = 0; j < 100; j++) {
+			char *scratch = str_printf(pools[i], "%zu", j);
+			mempool_add(pools[i], scratch, count_free);
+			mempool_alloc(pools[i], 10000);
+		}
+		char *last = mempool_alloc(pools[i], 32);
+		memset(last, 'x', 32);
+		mempool_rollback(pools[i], mark);
+		TEST(freed == 100);
+		TEST_STREQ(keep, "keep");
+		char *again = mempool_alloc(pools[i], 32);
+		TEST(again[0] == 0 && again[31] == 0);
+		mempool_rollback(pools[i], mark);
+		mempool_rollback(pools[i], mempool_mark(pools[i]));
+		TEST(freed == 100);
+		mempool_free(pools[i]);
+		TEST(freed == 101);
+	}
+
+	struct Mempool *parent = mempool_new_unique();
+	child = mempool_new_arena();
+	struct Mempool *grandchild = mempool_new();
+	char *x = str_dup(NULL, "x");
+	char *y = str_dup(NULL, "y");
+	freed = 0;
+	mempool_add(child, x, count_free);
+	mempool_add(child, y, count_free);
+	mempool_add(grandchild, str_dup(NULL, "z"), free);
+	char *w = str_dup(child, "w");
+	mempool_inherit(child, grandchild);
+	mempool_add(parent, x, count_free);
+	struct MempoolMark mark = mempool_mark(parent);
+	mempool_inherit(parent, child);
+	mempool_inherit(child, parent);
+	mempool_free(child);
+	TEST_STREQ(w, "w");
+	TEST(mempool_release(parent, y) == y);
+	TEST(freed == 1);
+	free(y);
+	mempool_rollback(parent, mark);
+	TEST(freed == 1);
+	mempool_free(parent);
+	TEST(freed == 2);
+	free(x);
+
+	parent = mempool_new();
+	child = mempool_new();
+	mempool_add(child, x = str_dup(NULL, "x"), count_free);
+	mempool_inherit(parent, child);
+	TEST(mempool_forget(parent, child) == child);
+	mempool_free(parent);
+	TEST(freed == 2);
+	mempool_free(child);
+	TEST(freed == 3);
+	free(x);
+
+	struct Mempool *shared[] = { mempool_new_concurrent(), mempool_new_local() };
+	for (size_t i = 0; i < nitems(shared); i++) {
+		pthread_t threads[THREADS];
+		for (size_t j = 0; j < nitems(threads); j++) {
+			pthread_create(&threads[j], NULL, worker, shared[i]);
+		}
+		for (size_t j = 0; j < nitems(threads); j++) {
+			pthread_join(threads[j], NULL);
+		}
+		struct MempoolStats shared_stats;
+		mempool_stats(shared[i], &shared_stats);
+		if (i == 1) {
+			// Threads of local pools peak on their own
+			TEST(shared_stats.objects == THREADS * OBJECTS);
+			TEST(shared_stats.peak_objects == OBJECTS + 1);
+		}
+		freed = 0;
+		mempool_free(shared[i]);
+		TEST(freed == THREADS * OBJECTS);
+	}
+
+	// Shared pools stay safe to use after they were inherited and
+	// are torn down completely with their owner
+	struct Mempool *inherited[] = { mempool_new_concurrent(), mempool_new_local() };
+	for (size_t i = 0; i < nitems(inherited); i++) {
+		struct Mempool *owner = mempool_new();
+		pthread_t threads[THREADS];
+		for (size_t j = 0; j < nitems(threads); j++) {
+			pthread_create(&threads[j], NULL, worker, inherited[i]);
+		}
+		mempool_inherit(owner, inherited[i]);
+		for (size_t j = 0; j < nitems(threads); j++) {
+			pthread_join(threads[j], NULL);
+		}
+		freed = 0;
+		mempool_free(owner);
+		TEST(freed == THREADS * OBJECTS);
+	}
+
+	struct Mempool *profiled = mempool_new();
+	mempool_profile(profiled);
+	for (size_t i = 0; i < 10; i++) {
+		str_printf(profiled, "%zu", i);
+	}
+	struct Array *array = mempool_array(profiled);
+	struct MempoolStats stats;
+	mempool_stats(profiled, &stats);
+	TEST(stats.objects == 11);
+	TEST(stats.bytes == 20);
+	child = mempool_new_arena();
+	str_dup(child, "foo");
+	mempool_inherit(profiled, child);
+	mempool_stats(profiled, &stats);
+	TEST(stats.objects == 12);
+	TEST(stats.bytes == 24);
+	TEST(stats.chunk_bytes > 0);
+	TEST(stats.inherited == 1);
+	mempool_release(profiled, array);
+	mempool_release(profiled, child);
+	mempool_stats(profiled, &stats);
+	TEST(stats.objects == 10);
+	TEST(stats.bytes == 20);
+	TEST(stats.chunk_bytes == 0);
+	TEST(stats.inherited == 0);
+	TEST(stats.peak_objects == 12);
+	TEST(stats.peak_bytes == 24);
+	FILE *fp = tmpfile();
+	mempool_dump(profiled, fp);
+	rewind(fp);
+	char *dump = slurp(fp, pool);
+	fclose(fp);
+	TEST(strstr(dump, "objects: 10 (peak 12)\n") != NULL);
+	TEST(strstr(dump, "\n20 bytes in 10 allocations (10 live) at tests/mempool/mempool.c:") != NULL);
+	TEST(strstr(dump, "\n0 bytes in 1 allocations (0 live) at tests/mempool/mempool.c:") != NULL);
+	mempool_free(profiled);
+
+	// Nested calls are attributed to their own callsite
+	struct Mempool *nested = mempool_new();
+	mempool_profile(nested);
+	mempool_alloc(nested, strlen(str_printf(nested, "%d", 100)));
+	fp = tmpfile();
+	mempool_dump(nested, fp);
+	rewind(fp);
+	dump = slurp(fp, pool);
+	fclose(fp);
+	TEST(strstr(dump, "\n7 bytes in 2 allocations (2 live) at tests/mempool/mempool.c:") != NULL);
+	TEST(strstr(dump, "(unknown)") == NULL);
+	mempool_free(nested);
+
+	freed = 0;
+	for (size_t i = 0; i < 100; i++) {
+		struct Mempool *doomed = mempool_new_arena();
+		for (size_t j = 0; j < 100; j++) {
+			mempool_add(doomed, mempool_alloc(doomed, 1), count_free);
+		}
+		child = mempool_new_arena();
+		mempool_add(child, mempool_alloc(child, 1), count_free);
+		mempool_inherit(doomed, child);
+		// Inherited pools are freed with their owner
+		mempool_free_async(child);
+		mempool_free_async(doomed);
+	}
+	mempool_free_async(NULL);
+	mempool_drain();
+	TEST(freed == 100 * 101);
+	mempool_drain();
+
+	struct Mempool *scratch = mempool_new_arena();
+	mempool_alloc(scratch, 16);
+	mark = mempool_mark(scratch);
+	char *dirty = mempool_alloc_uninit(scratch, 64);
+	memset(dirty, 'x', 64);
+	mempool_rollback(scratch, mark);
+	char *clean = mempool_alloc(scratch, 64);
+	TEST(clean == dirty);
+	size_t zeroes = 0;
+	for (size_t i = 0; i < 64; i++) {
+		zeroes += clean[i] == 0;
+	}
+	TEST(zeroes == 64);
+
+	// Arena memory cannot be taken out of its pool unless it was
+	// registered
+	char *registered = mempool_add(scratch, mempool_alloc(scratch, 1), count_free);
+	freed = 0;
+	TEST(mempool_release(scratch, registered) == registered);
+	TEST(freed == 1);
+	TEST(mempool_forget(scratch, &freed) == (void *)&freed);
+	struct Mempool *outer = mempool_new();
+	mempool_inherit(outer, scratch);
+	for (int i = 0; i < 3; i++) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			freopen("/dev/null", "w", stderr);
+			switch (i) {
+			case 0: mempool_forget(scratch, clean); break;
+			case 1: mempool_move(scratch, clean, pool); break;
+			case 2: mempool_release(outer, clean + 1); break;
+			}
+			_exit(0);
+		}
+		int status;
+		TEST(waitpid(pid, &status, 0) == pid && WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+	}
+	mempool_free(outer);
+}
@@ -0,0 +1,140 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2021 Tobias Kortkamp <tobik@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mempool.h"
+#include "mpmc.h"
+#include "str.h"
+#include "test.h"
+#include "util.h"
+
+#define PRODUCERS 4
+#define CONSUMERS 4
+#define ITEMS 100000
+
+struct Consumer {
+	pthread_t thread;
+	struct MPMC *queue;
+	uint64_t sum;
+	size_t n;
+};
+
+static void *
+producer(void *userdata)
+{
+	struct MPMC *queue = userdata;
+	uintptr_t values[16];
+	for (uintptr_t i = 1; i <= ITEMS; ) {
+		if (i % 3 == 0) {
+			size_t n = 0;
+			for (; n < nitems(values) && i + n <= ITEMS; n++) {
+				values[n] = i + n;
+			}
+			size_t pushed = mpmc_push_batch(queue, (void **)values, n);
+			if (pushed == 0) {
+				mpmc_push_wait(queue, (void *)i);
+				pushed = 1;
+			}
+			i += pushed;
+		} else {
+			mpmc_push_wait(queue, (void *)i);
+			i++;
+		}
+	}
+	return NULL;
+}
+
+static void *
+consumer(void *userdata)
+{
+	struct Consumer *c = userdata;
+	void *value;
+	while ((value = mpmc_pop_wait(c->queue))) {
+		c->sum += (uintptr_t)value;
+		c->n++;
+	}
+	return NULL;
+}
+
+TESTS() {
+	struct MPMC *queue = mpmc_new(3);
+	TEST(mpmc_capacity(queue) == 4);
+	TEST(mpmc_pop(queue) == NULL);
+	TEST(mpmc_push(queue, "1"));
+	TEST(mpmc_push(queue, "2"));
+	const char *values[] = { "3", "4", "5" };
+	TEST(mpmc_push_batch(queue, (void **)values, nitems(values)) == 2);
+	TEST(!mpmc_push(queue, "6"));
+	TEST_STREQ(mpmc_pop(queue), "1");
+	TEST(mpmc_push(queue, "5"));
+	void *out[8];
+	TEST(mpmc_pop_batch(queue, out, nitems(out)) == 4);
+	TEST_STREQ(out[0], "2");
+	TEST_STREQ(out[3], "5");
+	TEST(mpmc_pop(queue) == NULL);
+	TEST(mpmc_push(queue, NULL));
+	TEST(mpmc_pop_batch(queue, out, nitems(out)) == 1);
+	TEST(out[0] == NULL);
+	TEST(mpmc_pop_batch(queue, out, nitems(out)) == 0);
+	mpmc_close(queue);
+	TEST(mpmc_pop_wait(queue) == NULL);
+	TEST(!mpmc_push_wait(queue, "1"));
+	mpmc_free(queue);
+
+	queue = mpmc_new(64);
+	pthread_t producers[PRODUCERS];
+	struct Consumer consumers[CONSUMERS];
+	for (size_t i = 0; i < CONSUMERS; i++) {
+		consumers[i] = (struct Consumer){ .queue = queue };
+		pthread_create(&consumers[i].thread, NULL, consumer, &consumers[i]);
+	}
+	for (size_t i = 0; i < PRODUCERS; i++) {
+		pthread_create(&producers[i], NULL, producer, queue);
+	}
+	for (size_t i = 0; i < PRODUCERS; i++) {
+		pthread_join(producers[i], NULL);
+	}
+	mpmc_close(queue);
+	uint64_t sum = 0;
+	size_t n = 0;
+	for (size_t i = 0; i < CONSUMERS; i++) {
+		pthread_join(consumers[i].thread, NULL);
+		sum += consumers[i].sum;
+		n += consumers[i].n;
+	}
+	TEST(n == PRODUCERS * ITEMS);
+	TEST(sum == (uint64_t)PRODUCERS * ITEMS * (ITEMS + 1) / 2);
+	mpmc_free(queue);
+}
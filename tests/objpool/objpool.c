@@ -0,0 +1,92 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2020 Tobias Kortkamp <tobik@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mempool.h"
+#include "objpool.h"
+#include "str.h"
+#include "test.h"
+
+struct Point {
+	int x;
+	int y;
+};
+
+TESTS() {
+	struct Objpool *objpool = mempool_objpool(pool, sizeof(struct Point));
+	TEST(objpool_len(objpool) == 0);
+
+	struct Point *points[100];
+	for (size_t i = 0; i < nitems(points); i++) {
+		points[i] = objpool_alloc(objpool);
+		TEST_IF(points[i] != NULL) {
+			TEST(points[i]->x == 0 && points[i]->y == 0);
+			TEST((uintptr_t)points[i] % sizeof(void *) == 0);
+			points[i]->x = i;
+			points[i]->y = -i;
+		}
+	}
+	TEST(objpool_len(objpool) == 100);
+	TEST(points[42]->x == 42 && points[42]->y == -42);
+
+	// Released objects are reused and zeroed again
+	struct Point *p = points[10];
+	objpool_release(objpool, p);
+	objpool_release(objpool, NULL);
+	TEST(objpool_len(objpool) == 99);
+	points[10] = objpool_alloc(objpool);
+	TEST(points[10] == p);
+	TEST(p->x == 0 && p->y == 0);
+	TEST(objpool_len(objpool) == 100);
+	TEST(points[11]->x == 11 && points[9]->y == -9);
+
+	for (size_t i = 0; i < nitems(points); i++) {
+		objpool_release(objpool, points[i]);
+	}
+	TEST(objpool_len(objpool) == 0);
+
+	objpool_truncate(objpool);
+	TEST(objpool_len(objpool) == 0);
+	p = objpool_alloc(objpool);
+	TEST(p->x == 0 && p->y == 0);
+	TEST(objpool_len(objpool) == 1);
+
+	// Objects are at least large enough for the free list link
+	struct Objpool *bytes = mempool_objpool(pool, 1);
+	char *a = objpool_alloc(bytes);
+	char *b = objpool_alloc(bytes);
+	TEST((size_t)(b > a ? b - a : a - b) >= sizeof(void *));
+	objpool_release(bytes, a);
+	TEST(objpool_alloc(bytes) == a);
+}
@@ -69,4 +69,42 @@ TESTS() {
 	queue_push(queue, "1");
 	TEST_STREQ(queue_dequeue(queue), "1");
 	TEST(queue_pop(queue) == NULL);
+
+	queue = mempool_queue(pool);
+	for (size_t i = 0; i < 10; i++) {
+		queue_push(queue, str_printf(pool, "%zu", i));
+	}
+	for (size_t i = 0; i < 5; i++) {
+		queue_pop(queue);
+	}
+	for (size_t i = 10; i < 20; i++) {
+		queue_push(queue, str_printf(pool, "%zu", i));
+	}
+	queue_push_front(queue, "4");
+	TEST(queue_len(queue) == 16);
+	TEST_STREQ(queue_peek(queue), "4");
+	TEST_STREQ(queue_peek_back(queue), "19");
+	size_t n = 0;
+	QUEUE_FOREACH(queue, char *, s) {
+		TEST_IF(n == s_index) {
+			TEST(strtol(s, NULL, 10) == (long)n + 4);
+		}
+		n++;
+	}
+	TEST(n == 16);
+	queue_push(queue, "20");
+	TEST(queue_len(queue) == 17);
+	TEST(queue_contains(queue, "20"));
+	TEST_STREQ(queue_dequeue(queue), "20");
+	TEST_STREQ(queue_pop(queue), "4");
+	TEST_STREQ(queue_pop(queue), "5");
+	queue_truncate(queue);
+	TEST(queue_len(queue) == 0);
+	TEST(queue_peek_back(queue) == NULL);
+	n = 0;
+	QUEUE_FOREACH(queue, char *, s) {
+		TEST(s != NULL);
+		n++;
+	}
+	TEST(n == 0);
 }
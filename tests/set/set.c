@@ -0,0 +1,172 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2021 Tobias Kortkamp <tobik@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "array.h"
+#include "mempool.h"
+#include "set.h"
+#include "str.h"
+#include "test.h"
+#include "util.h"
+
+static struct Set *
+set_of(struct Mempool *pool, const char *elements)
+{
+	struct Set *set = mempool_set(pool, str_compare, NULL, NULL);
+	for (const char *p = elements; *p; p++) {
+		set_add(set, str_ndup(pool, p, 1));
+	}
+	return set;
+}
+
+static char *
+set_join(struct Mempool *pool, struct Set *set)
+{
+	return str_join(pool, set_values(set, pool), "");
+}
+
+TESTS() {
+	struct Set *a = set_of(pool, "abcdf");
+	struct Set *b = set_of(pool, "bdeg");
+	TEST_STREQ(set_join(pool, set_union(a, b, pool)), "abcdefg");
+	TEST_STREQ(set_join(pool, set_intersect(a, b, pool)), "bd");
+	TEST_STREQ(set_join(pool, set_difference(a, b, pool)), "acf");
+	TEST_STREQ(set_join(pool, set_difference(b, a, pool)), "eg");
+	TEST(set_len(set_intersect(a, set_of(pool, "xyz"), pool)) == 0);
+	TEST(set_len(a) == 5);
+	TEST(set_len(b) == 4);
+
+	TEST(set_is_subset(set_of(pool, "bd"), a));
+	TEST(set_is_subset(set_of(pool, ""), a));
+	TEST(set_is_subset(a, a));
+	TEST(!set_is_subset(set_of(pool, "bde"), a));
+	TEST(!set_is_subset(set_of(pool, "z"), a));
+	TEST(!set_is_subset(a, b));
+
+	struct Set *c = set_of(pool, "abc");
+	set_union_inplace(c, set_of(pool, "cde"));
+	TEST_STREQ(set_join(pool, c), "abcde");
+	TEST(set_contains(c, "e"));
+	set_add(c, "f");
+	TEST(set_len(c) == 6);
+	set_intersect_inplace(c, set_of(pool, "bcfz"));
+	TEST_STREQ(set_join(pool, c), "bcf");
+	TEST(!set_contains(c, "a"));
+	set_difference_inplace(c, set_of(pool, "c"));
+	TEST_STREQ(set_join(pool, c), "bf");
+	set_remove(c, "b");
+	TEST_STREQ(set_join(pool, c), "f");
+
+	// Empty, disjoint, and identical inputs
+	struct Set *empty = set_of(pool, "");
+	struct Set *x = set_of(pool, "ace");
+	struct Set *y = set_of(pool, "bdf");
+	TEST(set_len(set_union(empty, empty, pool)) == 0);
+	TEST(set_len(set_intersect(empty, x, pool)) == 0);
+	TEST(set_len(set_intersect(x, empty, pool)) == 0);
+	TEST(set_len(set_difference(empty, x, pool)) == 0);
+	TEST_STREQ(set_join(pool, set_union(empty, x, pool)), "ace");
+	TEST_STREQ(set_join(pool, set_union(x, empty, pool)), "ace");
+	TEST_STREQ(set_join(pool, set_difference(x, empty, pool)), "ace");
+	TEST_STREQ(set_join(pool, set_union(x, y, pool)), "abcdef");
+	TEST(set_len(set_intersect(x, y, pool)) == 0);
+	TEST_STREQ(set_join(pool, set_difference(x, y, pool)), "ace");
+	TEST_STREQ(set_join(pool, set_union(x, x, pool)), "ace");
+	TEST_STREQ(set_join(pool, set_intersect(x, x, pool)), "ace");
+	TEST(set_len(set_difference(x, x, pool)) == 0);
+	TEST(set_is_subset(empty, empty));
+	TEST(!set_is_subset(x, empty));
+	TEST(!set_is_subset(x, y));
+
+	struct Set *d = set_of(pool, "");
+	set_union_inplace(d, empty);
+	TEST(set_len(d) == 0);
+	set_union_inplace(d, x);
+	TEST_STREQ(set_join(pool, d), "ace");
+	set_union_inplace(d, empty);
+	TEST_STREQ(set_join(pool, d), "ace");
+	set_union_inplace(d, d);
+	TEST_STREQ(set_join(pool, d), "ace");
+	set_union_inplace(d, y);
+	TEST_STREQ(set_join(pool, d), "abcdef");
+	set_intersect_inplace(d, d);
+	TEST_STREQ(set_join(pool, d), "abcdef");
+	set_intersect_inplace(d, x);
+	TEST_STREQ(set_join(pool, d), "ace");
+	set_intersect_inplace(d, y);
+	TEST(set_len(d) == 0);
+	set_union_inplace(d, x);
+	set_intersect_inplace(d, empty);
+	TEST(set_len(d) == 0);
+	set_union_inplace(d, x);
+	set_difference_inplace(d, empty);
+	TEST_STREQ(set_join(pool, d), "ace");
+	set_difference_inplace(d, y);
+	TEST_STREQ(set_join(pool, d), "ace");
+	set_difference_inplace(d, d);
+	TEST(set_len(d) == 0);
+
+	// Results do not own their elements.  They are shared with the
+	// inputs and outlive freeing the result.
+	struct Set *owned = mempool_set(pool, str_compare, NULL, free);
+	set_add(owned, str_dup(NULL, "x"));
+	set_add(owned, str_dup(NULL, "y"));
+	struct Set *result = set_union(owned, y, NULL);
+	TEST(set_get(result, "x") == set_get(owned, "x"));
+	TEST(set_get(result, "b") == set_get(y, "b"));
+	set_free(result);
+	result = set_intersect(owned, owned, NULL);
+	TEST(set_get(result, "y") == set_get(owned, "y"));
+	set_free(result);
+	result = set_difference(owned, y, NULL);
+	TEST(set_len(result) == 2);
+	set_free(result);
+	TEST_STREQ(set_join(pool, owned), "xy");
+	set_truncate(owned);
+
+	// The in-place variants free the elements they drop
+	set_add(owned, str_dup(NULL, "a"));
+	set_add(owned, str_dup(NULL, "b"));
+	set_add(owned, str_dup(NULL, "c"));
+	set_intersect_inplace(owned, set_of(pool, "abc"));
+	TEST_STREQ(set_join(pool, owned), "abc");
+	set_truncate(owned);
+
+	set_add(owned, str_dup(NULL, "a"));
+	set_add(owned, str_dup(NULL, "b"));
+	set_add(owned, str_dup(NULL, "c"));
+	set_difference_inplace(owned, set_of(pool, "b"));
+	TEST_STREQ(set_join(pool, owned), "ac");
+	set_remove(owned, "a");
+	TEST(set_len(owned) == 1);
+}
@@ -67,4 +67,38 @@ TESTS() {
 		i++;
 	}
 	TEST(i == 3);
+
+	TEST(sizeof(struct Stack) <= 6 * sizeof(void *));
+	SCOPE_STACK(local);
+	for (size_t i = 0; i < 100; i++) {
+		stack_push(&local, str_printf(pool, "%zu", i));
+	}
+	TEST(stack_len(&local) == 100);
+	TEST_STREQ(stack_peek(&local), "99");
+	TEST(stack_contains(&local, stack_peek(&local)));
+	for (size_t i = 0; i < 95; i++) {
+		stack_pop(&local);
+	}
+	TEST_STREQ(stack_pop(&local), "4");
+	i = 0;
+	STACK_FOREACH(&local, const char *, s) {
+		TEST_IF(i == s_index) {
+			TEST(strtol(s, NULL, 10) == 3 - (long)i);
+		}
+		i++;
+	}
+	TEST(i == 4);
+	stack_finish(&local);
+	TEST(stack_len(&local) == 0);
+	stack_push(&local, "1");
+	TEST_STREQ(stack_pop(&local), "1");
+
+	struct Stack embedded;
+	stack_init(&embedded);
+	TEST(stack_pop(&embedded) == NULL);
+	for (size_t i = 0; i < 20; i++) {
+		stack_push(&embedded, "1");
+	}
+	TEST(stack_len(&embedded) == 20);
+	stack_finish(&embedded);
 }
@@ -110,16 +110,35 @@ sort(void *base, size_t nmemb, size_t size, CompareFn compare, void *userdata)
 
 void *
 xmalloc(size_t size)
+{
+	void *x = xmalloc_uninit(size);
+	memset(x, 0, size);
+	return x;
+}
+
+// For buffers that are completely overwritten right away
+void *
+xmalloc_uninit(size_t size)
 {
 	void *x = malloc(size);
 	if (x == NULL) {
 		warn("malloc");
 		abort();
 	}
-	memset(x, 0, size);
 	return x;
 }
 
+void *
+xreallocarray(void *ptr, size_t nmemb, size_t size)
+{
+	ptr = reallocarray(ptr, nmemb, size);
+	if (ptr == NULL) {
+		warn("reallocarray");
+		abort();
+	}
+	return ptr;
+}
+
 void *
 xrecallocarray(void *ptr, size_t old, size_t nmemb, size_t size)
 {
@@ -42,4 +42,6 @@ typedef int (*CompareFn)(const void *, const void *, void *);
 void slice_to_range(size_t, ssize_t, ssize_t, size_t *, size_t *);
 void sort(void *, size_t, size_t, CompareFn, void *);
 void *xmalloc(size_t);
+void *xmalloc_uninit(size_t);
+void *xreallocarray(void *, size_t, size_t);
 void *xrecallocarray(void *, size_t, size_t, size_t);